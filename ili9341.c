@@ -22,6 +22,56 @@
 #include <linux/spi/spi.h>
 #include <linux/module.h>
 #include <linux/moduleparam.h>
+#include <linux/slab.h>
+#include <linux/of.h>
+#include <linux/of_gpio.h>
+#include <linux/kthread.h>
+#include <linux/sched.h>
+#include <linux/timer.h>
+#include <linux/completion.h>
+#include <linux/dma-mapping.h>
+#include <linux/version.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/mutex.h>
+#include <linux/ktime.h>
+#include <linux/uaccess.h>
+#include <linux/wait.h>
+
+#include "ili9341.h"
+
+//The driver started out on 3.x kernels; these keep it building on the ones
+//the DRM front end needs.
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 9, 0)
+#define init_kthread_worker		kthread_init_worker
+#define init_kthread_work		kthread_init_work
+#define queue_kthread_work		kthread_queue_work
+#define flush_kthread_worker		kthread_flush_worker
+#endif
+
+//READ_ONCE()/WRITE_ONCE() came in 3.19 and ACCESS_ONCE() left in 4.15.
+#ifndef READ_ONCE
+#define READ_ONCE(x)			ACCESS_ONCE(x)
+#define WRITE_ONCE(x, val)		(ACCESS_ONCE(x) = (val))
+#endif
+
+#if IS_ENABLED(CONFIG_DRM_KMS_HELPER) && IS_ENABLED(CONFIG_DRM_KMS_CMA_HELPER) && \
+    LINUX_VERSION_CODE >= KERNEL_VERSION(5, 11, 0) && \
+    LINUX_VERSION_CODE < KERNEL_VERSION(5, 18, 0)
+#define ILI9341_DRM
+#include <drm/drm_atomic_helper.h>
+#include <drm/drm_damage_helper.h>
+#include <drm/drm_drv.h>
+#include <drm/drm_fb_cma_helper.h>
+#include <drm/drm_fb_helper.h>
+#include <drm/drm_fourcc.h>
+#include <drm/drm_gem_cma_helper.h>
+#include <drm/drm_gem_framebuffer_helper.h>
+#include <drm/drm_managed.h>
+#include <drm/drm_modeset_helper_vtables.h>
+#include <drm/drm_probe_helper.h>
+#include <drm/drm_simple_kms_helper.h>
+#endif
 
 int rotate = 0;
 module_param(rotate, int, 0444);
@@ -32,48 +82,121 @@ module_param(rate, int, 0644);
 int mode_BGR = 1;
 module_param(mode_BGR, int, 0644);
 
+//Flushes run on a dedicated thread per panel instead of the shared system
+//workqueue. 0 keeps the thread SCHED_NORMAL, 1..99 makes it SCHED_FIFO with
+//that priority; the value can be changed per panel through sysfs later on.
+static int flush_prio;
+module_param(flush_prio, int, 0644);
+MODULE_PARM_DESC(flush_prio, "SCHED_FIFO priority of the flush thread (0 = SCHED_NORMAL)");
+
+//CPU the flush threads are bound to, -1 leaves them free to migrate.
+static int flush_cpu = -1;
+module_param(flush_cpu, int, 0444);
+MODULE_PARM_DESC(flush_cpu, "CPU to bind the flush threads to (-1 = any)");
+
+//Upper bound on flushes per second, 0 for none. Drawing faster than that
+//only ever sends the latest contents; changeable per panel through sysfs.
+static unsigned int max_fps;
+module_param(max_fps, uint, 0644);
+MODULE_PARM_DESC(max_fps, "Most flushes per second (0 = no limit)");
+
+//Keep the framebuffer in physically contiguous pages and send changed spans
+//straight out of it by DMA instead of converting them into a bounce buffer.
+//Needs an SPI controller that does 16-bit words; falls back to the vmalloc
+//framebuffer if it doesn't or the memory can't be had.
+static bool fb_dma;
+module_param(fb_dma, bool, 0444);
+MODULE_PARM_DESC(fb_dma, "Send from a DMA mapped framebuffer without bounce copies");
+
+//Upper end of the SPI clock ramp run at probe. Starting from the configured
+//speed the clock is raised step by step for as long as the ID registers
+//read back the same as at a safe speed, and the panel is left at the fastest
+//speed that passed. 0 skips the ramp.
+static unsigned int speed_ramp_max;
+module_param(speed_ramp_max, uint, 0444);
+MODULE_PARM_DESC(speed_ramp_max, "Ramp the SPI clock at probe up to this many Hz (0 = off)");
+
+//Register a DRM device with a simple display pipe instead of an fbdev
+//framebuffer. Atomic commits hand over their damage clips directly, so
+//nothing has to be found out through page faults.
+static bool use_drm;
+module_param_named(drm, use_drm, bool, 0444);
+MODULE_PARM_DESC(drm, "Register as a DRM/KMS device instead of fbdev");
+
+//fbcon text normally lands in the framebuffer and reaches the panel with
+//the pages around it. With the glyph path each line of text goes out as
+//one window holding exactly its cells.
+static bool glyph_cache = true;
+module_param(glyph_cache, bool, 0444);
+MODULE_PARM_DESC(glyph_cache, "Send console text in windows of its own");
+
 #define DEBUG
 
 #define ILI_COMMAND                     1
 #define ILI_DATA                        0
 
+/* DC line used when neither platform data nor devicetree provide one */
 #define ILI_GPIO_DC						42
 
 
-static int global_counter = 0;
-
-static struct ili9341 ili9341_data;
-
-static struct resource ili9341_resources[] = {
-	[0] = {
-		.start	= SW_VA_SRAM_BASE,
-		.end	= SW_VA_SRAM_BASE + SZ_4K - 1,
-		.flags	= IORESOURCE_MEM,
-	},
-	[1] = {
-		.start	= SW_INT_IRQNO_SPI01,
-		.end	= SW_INT_IRQNO_SPI01,
-		.flags	= IORESOURCE_IRQ,
-	},
+struct ili9341_page {
+        unsigned short x;
+        unsigned short y;
+        unsigned short *buffer;
+        unsigned short len;
 };
 
-static struct platform_device ili9341_device = {
-	.name		= "ili9341",
-	.id		= 0,
-	.dev		= {
-				.platform_data		= &ili9341_data,
-	},
-	.resource	= ili9341_resources,
-	.num_resources	= ARRAY_SIZE(ili9341_resources),
+//Transmit buffers are sized for a few of the longest rows the panel can
+//have in any rotation, so they're allocated once at probe and reused. While
+//one of them is on the bus the next one is being converted into.
+#define ILI9341_TX_BUFS			2
+#define ILI9341_TX_ROWS			8
+
+struct ili9341_txbuf {
+        void *buf;
+        struct spi_transfer t;
+        struct spi_message m;
+        struct completion done;
+        int busy;
 };
 
+//Console text cells are 8 pixels wide and up to ILI9341_GLYPH_ROWS high;
+//the ring holds the cells drawn since the last flush.
+#define ILI9341_GLYPH_ROWS		32
+#define ILI9341_GLYPH_RING		1024
 
-struct ili9341_page {
+//A cell drawn in fg and bg, framebuffer pixel values; bits has one byte per
+//row, leftmost pixel in the top bit.
+struct ili9341_glyph {
         unsigned short x;
         unsigned short y;
-        unsigned short *buffer;
-        unsigned short len;
-        int must_update;
+        unsigned short rows;
+        u16 fg;
+        u16 bg;
+        u8 bits[ILI9341_GLYPH_ROWS];
+};
+
+//An overlay as set through ILI9341IO_SET_SPRITE; gen counts image changes.
+struct ili9341_overlay {
+        int x;
+        int y;
+        unsigned int width;
+        unsigned int height;
+        u32 key;
+        int visible;
+        unsigned int gen;
+        void *pixels;
+};
+
+//Outcome of the last debugfs self-test.
+struct ili9341_selftest {
+        int ret;
+        unsigned int frames;
+        u64 flush_ns;
+        unsigned long pixels;
+        unsigned long errors;
+        u8 id[3];
+        u8 status[3];
 };
 
 struct ili9341 {
@@ -82,11 +205,100 @@ struct ili9341 {
         volatile unsigned short *ctrl_io;
         volatile unsigned short *data_io;
         struct fb_info *info;
+        struct fb_deferred_io defio;
+        struct kthread_worker flush_worker;
+        struct kthread_work flush_work;
+        struct task_struct *flush_thread;
+        struct timer_list flush_timer;
+        int flush_prio;
+        int dc_gpio;
+        int rotate;
+        int bgr;
         unsigned int pages_count;
         struct ili9341_page *pages;
+        //Copy of what the panel currently shows, in framebuffer layout.
+        void *shadow;
+        //Cost of opening a window, in pixels of data that could have been
+        //sent instead.
+        unsigned int window_cost;
+        //Framebuffer to controller pixel format conversion.
+        void (*convert)(void *dst, const void *src, unsigned int count);
+        //Pages waiting for the flush thread. Drawing paths only ever set
+        //bits here; the flush thread swaps whole words out into
+        //flush_pages, so neither side needs a lock.
+        unsigned long *dirty;
+        unsigned long *flush_pages;
+        //Pages of the priority regions, flushed ahead of the rest from
+        //flush_urgent; damage to them waits prio_delay jiffies if that's
+        //set.
+        unsigned long *prio_pages;
+        unsigned long *flush_urgent;
+        unsigned long prio_delay;
+        //Console cells on their way to the flush thread. fbcon only draws
+        //under the console lock, so imageblit is the one writer of
+        //glyph_head and the flush thread the one writer of glyph_tail.
+        //glyph_line gathers a run of cells for a single transfer.
+        struct ili9341_glyph *glyph_ring;
+        unsigned int glyph_head;
+        unsigned int glyph_tail;
+        u16 *glyph_line;
+        //Overlays as last set, under sprite_lock, and the copy the flush
+        //thread composes rows with, taken at the start of every flush.
+        //overlay_row holds one composed framebuffer row.
+        struct ili9341_overlay sprites[ILI9341_SPRITES];
+        struct ili9341_overlay flush_sprites[ILI9341_SPRITES];
+        spinlock_t sprite_lock;
+        void *sprite_pixels;
+        void *overlay_row;
+        //First and last page holding each framebuffer row.
+        unsigned short *row_first_page;
+        unsigned short *row_last_page;
         unsigned long pseudo_palette[25];
-        unsigned short *tmpbuf;
-        unsigned short *tmpbuf_be;
+        struct ili9341_txbuf tx[ILI9341_TX_BUFS];
+        unsigned int tx_size;
+        //Set when the framebuffer is contiguous and mapped for DMA by the
+        //SPI controller's device at fb_dma_addr.
+        int fb_dma;
+        struct device *dma_dev;
+        dma_addr_t fb_dma_addr;
+        //SPI clock for all transfers, 0 uses the device's max_speed_hz.
+        u32 speed_hz;
+        //Largest transfer in bytes, 0 takes the most the controller allows.
+        unsigned int chunk_size;
+        struct dentry *debugfs;
+        struct kthread_work verify_work;
+        struct kthread_work calibrate_work;
+        struct mutex selftest_lock;
+        struct ili9341_selftest selftest;
+        //New mmaps skip write fault tracking, set through
+        //ILI9341IO_SET_TRACKING.
+        int untracked;
+        int (*defio_mmap)(struct fb_info *info, struct vm_area_struct *vma);
+        //This panel's copy of ili9341_fbops; deferred io patches fb_mmap in it.
+        struct fb_ops fbops;
+        //Flushes started and finished, and when the last one finished; for
+        //ILI9341IO_FLUSH_WAIT.
+        u32 flush_started;
+        u32 flush_seq;
+        u64 flush_done_ns;
+        spinlock_t flush_lock;
+        wait_queue_head_t flush_wq;
+        //Flush rate limit and when the next flush may start.
+        unsigned int max_fps;
+        unsigned long next_flush;
+        //Set by ili9341_flush_stop(); the flush no longer rearms the timer.
+        int flush_stopping;
+        //Updates handed in by drawing paths, how many joined damage
+        //already waiting for a flush, and how many overwrote some of it
+        //before it reached the panel. pending is set from the first
+        //update to the flush that takes it.
+        atomic_t frames;
+        atomic_t coalesced;
+        atomic_t dropped;
+        atomic_t pending;
+        //DRM front end, used instead of the fbdev one when use_drm is set.
+        int use_drm;
+        struct ili9341_drm *drm;
 };
 
 static void ili9341_clear_graph(struct ili9341 *item);
@@ -96,6 +308,7 @@ int ili9341_write_spi(struct ili9341 *item, void *buf, size_t len)
 	struct spi_transfer t = {
 		.tx_buf = buf,
 		.len = len,
+		.speed_hz = item->speed_hz,
 	};
 	struct spi_message m;
 
@@ -117,6 +330,7 @@ int ili9341_write_spi_1_byte(struct ili9341 *item, unsigned char byte)
 	struct spi_transfer t = {
 		.tx_buf = &tmp_byte,
 		.len = 1,
+		.speed_hz = item->speed_hz,
 	};
 	struct spi_message m;
 
@@ -133,24 +347,70 @@ int ili9341_write_spi_1_byte(struct ili9341 *item, unsigned char byte)
 	return spi_sync(item->spi, &m);
 }
 
+//Read len bytes of the reply to cmd at speed_hz, or the current speed if
+//that is 0. The first dummy clock cycles of the reply (1 to 8) are dropped:
+//0xd3 and 0x2e start with a dummy byte, 0x04 and 0x09 with a single bit.
+static int ili9341_read_reg(struct ili9341 *item, u8 cmd, u8 *data,
+			    size_t len, unsigned int dummy, u32 speed_hz)
+{
+	struct spi_transfer t[2];
+	struct spi_message m;
+	unsigned int shift = dummy & 7;
+	const u8 *src;
+	size_t i;
+	u8 *buf;
+	int ret;
+
+	buf = kmalloc(len + 2, GFP_KERNEL | GFP_DMA);
+	if (!buf)
+		return -ENOMEM;
+	buf[0] = cmd;
+
+	memset(t, 0, sizeof(t));
+	t[0].tx_buf = buf;
+	t[0].len = 1;
+	t[0].speed_hz = speed_hz ? speed_hz : item->speed_hz;
+	t[1].rx_buf = buf + 1;
+	t[1].len = len + 1;
+	t[1].speed_hz = t[0].speed_hz;
+	spi_message_init(&m);
+	spi_message_add_tail(&t[0], &m);
+	spi_message_add_tail(&t[1], &m);
+
+	//DC is only sampled with the command byte, so it can stay low for
+	//the reply and CS is held across both.
+	gpio_set_value(item->dc_gpio, 0);
+	ret = spi_sync(item->spi, &m);
+	gpio_set_value(item->dc_gpio, 1);
+	if (!ret) {
+		src = buf + 1 + dummy / 8;
+		for (i = 0; i < len; i++)
+			data[i] = shift ? (src[i] << shift) |
+					  (src[i + 1] >> (8 - shift)) : src[i];
+	}
+
+	kfree(buf);
+	return ret;
+}
+
 static int ili9341_init_gpio(struct ili9341 *item)
 {
 	//DC high - data, DC low - command
-	return gpio_request_one(ILI_GPIO_DC, GPIOF_OUT_INIT_HIGH,
-		item->info->device->driver->name);
+	return gpio_request_one(item->dc_gpio, GPIOF_OUT_INIT_HIGH,
+		dev_name(item->dev));
 }
 
-static void ili9341_free_gpio(void)
+static void ili9341_free_gpio(struct ili9341 *item)
 {
-	gpio_free(ILI_GPIO_DC);
+	gpio_free(item->dc_gpio);
 }
 
 static void ili9341_write_data(struct ili9341 *item, unsigned char dc, unsigned char value) {
 
 	if (dc == ILI_COMMAND) {
-		gpio_set_value(ILI_GPIO_DC, 0);
+		gpio_set_value(item->dc_gpio, 0);
 		ili9341_write_spi_1_byte(item, value);
-		gpio_set_value(ILI_GPIO_DC, 1);
+		gpio_set_value(item->dc_gpio, 1);
 	} else { //ILI_DATA
 		ili9341_write_spi_1_byte(item, value);
 	}
@@ -164,44 +424,64 @@ static void ili9341_write_data(struct ili9341 *item, unsigned char dc, unsigned
 #define MEM_BGR (3) /* RGB-BGR Order */
 #define MEM_H   (2) /* MH horizontal refresh order */
 
-void ili9341_set_display_res(struct ili9341 *item, int xres, int yres,
-		int xres_virtual, int yres_virtual, int width, int height)
+//Physical size of the PiTFT 2.8" active area, in portrait.
+#define ILI9341_WIDTH_MM		43
+#define ILI9341_HEIGHT_MM		58
+
+//The framebuffer is portrait at 0 and 180 degrees and landscape at 90 and
+//270. The controller swaps rows and columns itself (MV), so the framebuffer
+//is always sent row by row and pages, windows and damage work the same way
+//in every orientation. Has to run before anything is sized from var.
+static void ili9341_set_geometry(struct ili9341 *item)
 {
-	item->info->var.xres = xres;
-	item->info->var.yres = yres;
-	item->info->var.xres_virtual = xres_virtual;
-	item->info->var.yres_virtual = yres_virtual;
-	item->info->var.width = width;
-	item->info->var.height = height;
-	item->info->fix.line_length = xres * 2;
+	struct fb_var_screeninfo *var = &item->info->var;
+
+	if (item->rotate == 90 || item->rotate == 270) {
+		var->xres = 320;
+		var->yres = 240;
+		var->width = ILI9341_HEIGHT_MM;
+		var->height = ILI9341_WIDTH_MM;
+	} else {
+		var->xres = 240;
+		var->yres = 320;
+		var->width = ILI9341_WIDTH_MM;
+		var->height = ILI9341_HEIGHT_MM;
+	}
+	var->xres_virtual = var->xres;
+	var->yres_virtual = var->yres;
+	item->info->fix.line_length = var->xres * (var->bits_per_pixel / 8);
 }
 
-static void ili9341_set_display_options(struct ili9341 *item)
+//Address mode for the rotation, with the red/blue swap for BGR panels so
+//the framebuffer stays plain RGB565 either way.
+static u8 ili9341_madctl(struct ili9341 *item)
 {
-	//rotate
-	ili9341_write_data(item, ILI_COMMAND, 0x36);
-	switch (rotate)
-	{
-	case 0:
-		ili9341_write_data(item, ILI_DATA, 1 << MEM_X);
-		ili9341_set_display_res(item, 240, 320, 240, 320, 240, 320);
-		break;
+	u8 madctl;
 
+	switch (item->rotate) {
 	case 90:
-		ili9341_write_data(item, ILI_DATA, (1 << MEM_Y) | (1 << MEM_X) | (1 << MEM_V));
-		ili9341_set_display_res(item, 320, 240, 320, 240, 320, 240);
+		madctl = (1 << MEM_Y) | (1 << MEM_X) | (1 << MEM_V);
 		break;
-
 	case 180:
-		ili9341_write_data(item, ILI_DATA, 1 << MEM_Y);
-		ili9341_set_display_res(item, 240, 320, 240, 320, 240, 320);
+		madctl = 1 << MEM_Y;
 		break;
-
 	case 270:
-		ili9341_write_data(item, ILI_DATA, (1<<MEM_V) | (1 << MEM_L));
-		ili9341_set_display_res(item, 320, 240, 320, 240, 320, 240);
+		madctl = (1 << MEM_V) | (1 << MEM_L);
+		break;
+	default:
+		madctl = 1 << MEM_X;
 		break;
 	}
+	if (item->bgr)
+		madctl |= 1 << MEM_BGR;
+
+	return madctl;
+}
+
+static void ili9341_set_display_options(struct ili9341 *item)
+{
+	ili9341_write_data(item, ILI_COMMAND, 0x36);
+	ili9341_write_data(item, ILI_DATA, ili9341_madctl(item));
 }
 
 /* Init sequence taken from: Arduino Library for the Adafruit 2.2" display */
@@ -284,17 +564,9 @@ static int ili9341_init_display(struct ili9341 *item)
 	ili9341_write_data(item, ILI_DATA, 0x82);
 	ili9341_write_data(item, ILI_DATA, 0x27);
 
-	/* MADCTL, required to resolve 'mirroring' effect */
-	ili9341_write_data(item, ILI_COMMAND, 0x36);
-	if (mode_BGR)	{
-		ili9341_write_data(item, ILI_DATA, 0x48);
-		ili9341_set_display_options(item);
-		printk("COLOR LCD in BGR mode\n");
-	} else 	{
-		ili9341_write_data(item, ILI_DATA, 0x40);
-		ili9341_set_display_options(item);
-		printk("COLOR LCD in RGB mode\n");
-	}
+	/* MADCTL: rotation and red/blue order */
+	ili9341_set_display_options(item);
+	dev_info(item->dev, "COLOR LCD in %s mode\n", item->bgr ? "BGR" : "RGB");
 
 
 	/* Gamma Function Disable */
@@ -351,7 +623,7 @@ static int ili9341_init_display(struct ili9341 *item)
 
 	ili9341_clear_graph(item);
 
-	printk("COLOR LCD driver initialized\n");
+	dev_info(item->dev, "COLOR LCD driver initialized\n");
 
 
 	return 0;
@@ -359,7 +631,7 @@ static int ili9341_init_display(struct ili9341 *item)
 
 static void ili9341_set_window(struct ili9341 *item, int xs, int ys, int xe, int ye)
 {
-	printk("%s(xs=%d, ys=%d, xe=%d, ye=%d)\n", __func__, xs, ys, xe, ye);
+	dev_dbg(item->dev, "%s(xs=%d, ys=%d, xe=%d, ye=%d)\n", __func__, xs, ys, xe, ye);
 
 	/* Column address */
 	ili9341_write_data(item, ILI_COMMAND, 0x2A);
@@ -379,34 +651,179 @@ static void ili9341_set_window(struct ili9341 *item, int xs, int ys, int xe, int
 	ili9341_write_data(item, ILI_COMMAND, 0x2C);
 }
 
+//Used when the kernel can't tell how much the controller takes at once.
+#define ILI9341_MAX_TRANSFER		65532
+
+//Bytes that may go out in one transfer from a buffer of limit bytes. Always
+//even, so pixels are never split across transfers.
+static unsigned int ili9341_chunk(struct ili9341 *item, unsigned int limit)
+{
+	unsigned int chunk_size = item->chunk_size;
+	size_t max;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 6, 0)
+	max = spi_max_transfer_size(item->spi);
+#else
+	max = ILI9341_MAX_TRANSFER;
+#endif
+	if (chunk_size)
+		max = min_t(size_t, max, chunk_size);
+
+	return min_t(size_t, max, limit) & ~1;
+}
+
 static void ili9341_clear_graph(struct ili9341 *item)
 {
-	switch (rotate)
-	{
-	case 0:
-	case 180:
-		ili9341_set_window(item, 0x0000, 0x0000, 0x00ef, 0x013f);
-		break;
-	case 90:
-	case 270:
-		ili9341_set_window(item, 0x0000, 0x0000, 0x013f, 0x00ef);
-		break;
+	unsigned int len = item->info->var.yres * item->info->fix.line_length;
+	unsigned int chunk;
+
+	ili9341_set_window(item, 0, 0, item->info->var.xres - 1,
+			   item->info->var.yres - 1);
+
+	//The shadow starts out black, so the panel has to as well.
+	memset(item->tx[0].buf, 0, item->tx_size);
+	while (len) {
+		chunk = min(len, ili9341_chunk(item, item->tx_size));
+		ili9341_write_spi(item, item->tx[0].buf, chunk);
+		len -= chunk;
 	}
 }
 
+//Arm the flush timer for delay from now, unless it already fires sooner.
+static void ili9341_schedule_flush_in(struct ili9341 *item,
+                                      unsigned long delay)
+{
+        unsigned long when = jiffies + delay;
+
+        if (!timer_pending(&item->flush_timer) ||
+            time_before(when, item->flush_timer.expires))
+                mod_timer(&item->flush_timer, when);
+}
+
+static void ili9341_schedule_flush(struct ili9341 *item)
+{
+        ili9341_schedule_flush_in(item, item->defio.delay);
+}
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 15, 0)
+static void ili9341_flush_timer(unsigned long data)
+{
+        struct ili9341 *item = (struct ili9341 *)data;
+#else
+static void ili9341_flush_timer(struct timer_list *t)
+{
+        struct ili9341 *item = from_timer(item, t, flush_timer);
+#endif
+
+        queue_kthread_work(&item->flush_worker, &item->flush_work);
+}
+
+//Returns whether the page was already dirty.
+static inline int ili9341_mark_page(struct ili9341 *item, unsigned int index)
+{
+        return test_and_set_bit(index, item->dirty);
+}
+
+//Set the dirty bits of the pages under rows [y, y + h).
+static int ili9341_mark_rows(struct ili9341 *item, unsigned int y,
+                             unsigned int h)
+{
+        unsigned int i, last = item->row_last_page[y + h - 1];
+        int superseded = 0;
+
+        //Pairs with the xchg() in ili9341_flush().
+        smp_wmb();
+        for (i = item->row_first_page[y]; i <= last; i++)
+                superseded |= ili9341_mark_page(item, i);
+        return superseded;
+}
+
+//prio_delay if rows [y, y + h) touch a priority page, defio.delay if not.
+static unsigned long ili9341_rows_delay(struct ili9341 *item, unsigned int y,
+                                        unsigned int h)
+{
+        unsigned int i, last = item->row_last_page[y + h - 1];
+
+        if (item->prio_delay)
+                for (i = item->row_first_page[y]; i <= last; i++)
+                        if (test_bit(i, item->prio_pages))
+                                return item->prio_delay;
+        return item->defio.delay;
+}
+
+//Update the frames/coalesced/dropped counters shown in debugfs.
+static void ili9341_count_frame(struct ili9341 *item, int superseded)
+{
+        atomic_inc(&item->frames);
+        if (atomic_xchg(&item->pending, 1))
+                atomic_inc(&item->coalesced);
+        if (superseded)
+                atomic_inc(&item->dropped);
+}
+
 static void ili9341_touch(struct fb_info *info, int x, int y, int w, int h)
 {
-      struct fb_deferred_io *fbdefio = info->fbdefio;
-      struct ili9341 *item = (struct ili9341 *)info->par;
+        struct fb_deferred_io *fbdefio = info->fbdefio;
+        struct ili9341 *item = (struct ili9341 *)info->par;
+
+        if (y < 0) {
+                h += y;
+                y = 0;
+        }
+        if (y + h > (int)info->var.yres)
+                h = info->var.yres - y;
+        if (fbdefio && h > 0) {
+                ili9341_count_frame(item, ili9341_mark_rows(item, y, h));
+                //Schedule the flush thread to kick in after a delay.
+                ili9341_schedule_flush_in(item,
+                                          ili9341_rows_delay(item, y, h));
+        }
+}
+
+
+//A DMA framebuffer is made of ordinary cacheable pages, so deferred io can
+//still map them into userspace and the diff reads them at full speed. They
+//stay mapped for the controller for the lifetime of the device; each span
+//is synced to the device right before it is sent.
+static int ili9341_fb_dma_alloc(struct ili9341 *item)
+{
+        void *buffer;
 
-      if (fbdefio) {
-          //Schedule the deferred IO to kick in after a delay.
-          schedule_delayed_work(&info->deferred_work, fbdefio->delay);
-      }
+        buffer = alloc_pages_exact(item->info->fix.smem_len,
+                                   GFP_KERNEL | __GFP_ZERO | __GFP_NOWARN);
+        if (!buffer)
+                return -ENOMEM;
+
+        item->fb_dma_addr = dma_map_single(item->dma_dev, buffer,
+                                           item->info->fix.smem_len,
+                                           DMA_TO_DEVICE);
+        if (dma_mapping_error(item->dma_dev, item->fb_dma_addr)) {
+                free_pages_exact(buffer, item->info->fix.smem_len);
+                return -ENOMEM;
+        }
+
+        //Deferred io looks pages up by physical address when the buffer
+        //isn't vmalloc()ed.
+        item->info->screen_base = (char __iomem *)buffer;
+        item->info->fix.smem_start = virt_to_phys(buffer);
+
+        return 0;
 }
 
+static void ili9341_fb_free(struct ili9341 *item)
+{
+        void *buffer = (void __force *)item->info->screen_base;
+
+        if (item->fb_dma) {
+                dma_unmap_single(item->dma_dev, item->fb_dma_addr,
+                                 item->info->fix.smem_len, DMA_TO_DEVICE);
+                free_pages_exact(buffer, item->info->fix.smem_len);
+        } else {
+                vfree(buffer);
+        }
+}
 
-static int __init ili9341_video_alloc(struct ili9341 *item)
+static int ili9341_video_alloc(struct ili9341 *item)
 {
         unsigned int frame_size;
 
@@ -424,13 +841,52 @@ static int __init ili9341_video_alloc(struct ili9341 *item)
                 __func__, (void *)item, item->pages_count);
 
         item->info->fix.smem_len = item->pages_count * PAGE_SIZE;
-        item->info->fix.smem_start =
-            (unsigned short*) vmalloc(item->info->fix.smem_len);
-        if (!item->info->fix.smem_start) {
-                dev_err(item->dev, "%s: unable to vmalloc\n", __func__);
+        if (item->fb_dma && ili9341_fb_dma_alloc(item)) {
+                dev_warn(item->dev, "%s: no contiguous framebuffer, "
+                         "using vmalloc\n", __func__);
+                item->fb_dma = 0;
+        }
+        if (!item->fb_dma) {
+                //vmalloc_user() so untracked mappings can remap it, see
+                //ili9341_mmap().
+                item->info->screen_base =
+                    (char __iomem *)vmalloc_user(item->info->fix.smem_len);
+                if (!item->info->screen_base) {
+                        dev_err(item->dev, "%s: unable to vmalloc\n", __func__);
+                        return -ENOMEM;
+                }
+                memset((void *)item->info->screen_base, 0,
+                       item->info->fix.smem_len);
+                item->info->fix.smem_start =
+                    (unsigned long)item->info->screen_base;
+        }
+
+        //Both start out black: ili9341_clear_graph() blanks the panel.
+        item->shadow = vmalloc(item->info->fix.smem_len);
+        if (!item->shadow) {
+                dev_err(item->dev, "%s: unable to vmalloc shadow\n", __func__);
+                ili9341_fb_free(item);
                 return -ENOMEM;
         }
-        memset((void *)item->info->fix.smem_start, 0, item->info->fix.smem_len);
+        memset(item->shadow, 0, item->info->fix.smem_len);
+
+        //fbcon only draws text through the fbdev front end.
+        if (glyph_cache && !item->use_drm) {
+                item->glyph_ring = vmalloc(ILI9341_GLYPH_RING *
+                                           sizeof(struct ili9341_glyph));
+                item->glyph_line = vmalloc(max(item->info->var.xres,
+                                               item->info->var.yres) *
+                                           ILI9341_GLYPH_ROWS * 2);
+                if (!item->glyph_ring || !item->glyph_line) {
+                        dev_err(item->dev, "%s: unable to vmalloc glyph ring\n",
+                                __func__);
+                        vfree(item->glyph_line);
+                        vfree(item->glyph_ring);
+                        vfree(item->shadow);
+                        ili9341_fb_free(item);
+                        return -ENOMEM;
+                }
+        }
 
         return 0;
 }
@@ -439,13 +895,47 @@ static void ili9341_video_free(struct ili9341 *item)
 {
         dev_dbg(item->dev, "%s: item=0x%p\n", __func__, (void *)item);
 
-        kfree((void *)item->info->fix.smem_start);
+        vfree(item->glyph_line);
+        vfree(item->glyph_ring);
+        vfree(item->shadow);
+        ili9341_fb_free(item);
+}
+
+static void ili9341_tx_free(struct ili9341 *item)
+{
+        unsigned int i;
+
+        for (i = 0; i < ILI9341_TX_BUFS; i++) {
+                kfree(item->tx[i].buf);
+                item->tx[i].buf = NULL;
+        }
+}
+
+static int ili9341_tx_alloc(struct ili9341 *item)
+{
+        unsigned int i;
+
+        item->tx_size = max(item->info->var.xres, item->info->var.yres) *
+                        (item->info->var.bits_per_pixel / 8) * ILI9341_TX_ROWS;
+
+        for (i = 0; i < ILI9341_TX_BUFS; i++) {
+                item->tx[i].buf = kmalloc(item->tx_size, GFP_KERNEL | GFP_DMA);
+                if (!item->tx[i].buf) {
+                        dev_err(item->dev, "%s: unable to kmalloc tx buffer\n",
+                                __func__);
+                        ili9341_tx_free(item);
+                        return -ENOMEM;
+                }
+                init_completion(&item->tx[i].done);
+        }
+
+        return 0;
 }
 
 //This routine will allocate a ili9341_page struct for each vm page in the
 //main framebuffer memory. Each struct will contain a pointer to the page
 //start, an x- and y-offset, and the length of the pagebuffer which is in the framebuffer.
-static int __init ili9341_pages_alloc(struct ili9341 *item)
+static int ili9341_pages_alloc(struct ili9341 *item)
 {
         unsigned short pixels_per_page;
         unsigned short yoffset_per_page;
@@ -455,6 +945,7 @@ static int __init ili9341_pages_alloc(struct ili9341 *item)
         unsigned short y = 0;
         unsigned short *buffer;
         unsigned int len;
+        unsigned int row;
 
         dev_dbg(item->dev, "%s: item=0x%p\n", __func__, (void *)item);
 
@@ -466,6 +957,41 @@ static int __init ili9341_pages_alloc(struct ili9341 *item)
                 return -ENOMEM;
         }
 
+        item->dirty = kcalloc(BITS_TO_LONGS(item->pages_count),
+                              sizeof(unsigned long), GFP_KERNEL);
+        item->row_first_page = kcalloc(item->info->var.yres,
+                                      sizeof(unsigned short), GFP_KERNEL);
+        item->row_last_page = kcalloc(item->info->var.yres,
+                                     sizeof(unsigned short), GFP_KERNEL);
+        item->flush_pages = kcalloc(BITS_TO_LONGS(item->pages_count),
+                                    sizeof(unsigned long), GFP_KERNEL);
+        item->prio_pages = kcalloc(BITS_TO_LONGS(item->pages_count),
+                                   sizeof(unsigned long), GFP_KERNEL);
+        item->flush_urgent = kcalloc(BITS_TO_LONGS(item->pages_count),
+                                     sizeof(unsigned long), GFP_KERNEL);
+        item->overlay_row = kmalloc(item->info->fix.line_length, GFP_KERNEL);
+        //Two images per sprite, set and flushed, of up to 32 bits per
+        //pixel.
+        item->sprite_pixels = vmalloc(2 * ILI9341_SPRITES * 4 *
+                                      ILI9341_SPRITE_MAX * ILI9341_SPRITE_MAX);
+        if (!item->dirty || !item->flush_pages ||
+            !item->prio_pages || !item->flush_urgent ||
+            !item->overlay_row || !item->sprite_pixels ||
+            !item->row_first_page || !item->row_last_page) {
+                dev_err(item->dev, "%s: unable to kcalloc for dirty bitmap\n",
+                        __func__);
+                vfree(item->sprite_pixels);
+                kfree(item->overlay_row);
+                kfree(item->dirty);
+                kfree(item->flush_pages);
+                kfree(item->prio_pages);
+                kfree(item->flush_urgent);
+                kfree(item->row_first_page);
+                kfree(item->row_last_page);
+                kfree(item->pages);
+                return -ENOMEM;
+        }
+
         pixels_per_page = PAGE_SIZE / (item->info->var.bits_per_pixel / 8);
         yoffset_per_page = pixels_per_page / item->info->var.xres;
         xoffset_per_page = pixels_per_page -
@@ -475,7 +1001,7 @@ static int __init ili9341_pages_alloc(struct ili9341 *item)
                 __func__, (void *)item, pixels_per_page,
                 yoffset_per_page, xoffset_per_page);
 
-        buffer = (unsigned short *)item->info->fix.smem_start;
+        buffer = (unsigned short *)item->info->screen_base;
         for (index = 0; index < item->pages_count; index++) {
                 len = (item->info->var.xres * item->info->var.yres) -
                     (index * pixels_per_page);
@@ -499,6 +1025,23 @@ static int __init ili9341_pages_alloc(struct ili9341 *item)
                 buffer += pixels_per_page;
         }
 
+        for (index = 0; index < ILI9341_SPRITES; index++) {
+                item->sprites[index].pixels = item->sprite_pixels +
+                        index * 4 * ILI9341_SPRITE_MAX * ILI9341_SPRITE_MAX;
+                item->flush_sprites[index].pixels = item->sprite_pixels +
+                        (ILI9341_SPRITES + index) * 4 *
+                        ILI9341_SPRITE_MAX * ILI9341_SPRITE_MAX;
+        }
+
+        //Rows map to pages through their linear pixel offset. Precompute it so
+        //marking damage doesn't have to search the page list.
+        for (row = 0; row < item->info->var.yres; row++) {
+                item->row_first_page[row] =
+                    (row * item->info->var.xres) / pixels_per_page;
+                item->row_last_page[row] =
+                    ((row + 1) * item->info->var.xres - 1) / pixels_per_page;
+        }
+
         return 0;
 }
 
@@ -506,32 +1049,1036 @@ static void ili9341_pages_free(struct ili9341 *item)
 {
         dev_dbg(item->dev, "%s: item=0x%p\n", __func__, (void *)item);
 
+        kfree(item->row_last_page);
+        kfree(item->row_first_page);
+        vfree(item->sprite_pixels);
+        kfree(item->overlay_row);
+        kfree(item->flush_urgent);
+        kfree(item->prio_pages);
+        kfree(item->flush_pages);
+        kfree(item->dirty);
         kfree(item->pages);
 }
 
+//Pixel converters turn count framebuffer pixels into what the controller
+//takes in COLMOD 16 bit mode. The right one is picked once for the
+//framebuffer format, see ili9341_select_convert().
+static void ili9341_rgb565_to_be565(void *dst, const void *src,
+                                    unsigned int count)
+{
+#ifdef __LITTLE_ENDIAN
+        const u32 *s = src;
+        u32 *d = dst;
+        const u16 *s16;
+        u16 *d16;
+        u32 w;
+
+        //Swap two pixels per word when both buffers allow it.
+        if (!(((unsigned long)src | (unsigned long)dst) & 3)) {
+                for (; count >= 2; count -= 2) {
+                        w = *s++;
+                        *d++ = ((w & 0x00ff00ff) << 8) | ((w >> 8) & 0x00ff00ff);
+                }
+        }
+        s16 = (const u16 *)s;
+        d16 = (u16 *)d;
+        for (; count; count--)
+                *d16++ = swab16(*s16++);
+#else
+        memcpy(dst, src, count * 2);
+#endif
+}
+
+static int ili9341_select_convert(struct ili9341 *item)
+{
+        if (item->info->var.bits_per_pixel != 16) {
+                dev_err(item->dev, "%s: unsupported depth %u\n",
+                        __func__, item->info->var.bits_per_pixel);
+                return -EINVAL;
+        }
+        //Red/blue order is handled by MADCTL, see ili9341_madctl().
+        item->convert = ili9341_rgb565_to_be565;
+
+        return 0;
+}
+
+static void ili9341_tx_complete(void *context)
+{
+        struct ili9341_txbuf *tx = context;
+
+        complete(&tx->done);
+}
+
+static void ili9341_tx_wait(struct ili9341_txbuf *tx)
+{
+        if (tx->busy) {
+                wait_for_completion(&tx->done);
+                tx->busy = 0;
+        }
+}
+
+static int ili9341_tx_queue(struct ili9341 *item, struct ili9341_txbuf *tx,
+                            size_t len)
+{
+        int ret;
+
+        memset(&tx->t, 0, sizeof(tx->t));
+        tx->t.tx_buf = tx->buf;
+        tx->t.len = len;
+        tx->t.speed_hz = item->speed_hz;
+        spi_message_init(&tx->m);
+        spi_message_add_tail(&tx->t, &tx->m);
+        tx->m.complete = ili9341_tx_complete;
+        tx->m.context = tx;
+        init_completion(&tx->done);
+
+        ret = spi_async(item->spi, &tx->m);
+        if (ret) {
+                dev_err(item->dev, "%s: spi_async failed: %d\n",
+                        __func__, ret);
+                return ret;
+        }
+        tx->busy = 1;
+
+        return 0;
+}
+
+//Send pixels to the open memory window, converting the next chunk while the
+//previous one is still being transferred.
+static void ili9341_send_pixels(struct ili9341 *item, const void *buffer,
+                                unsigned int len)
+{
+        struct ili9341_txbuf *tx;
+        unsigned int chunk;
+        unsigned int i = 0;
+
+        while (len) {
+                tx = &item->tx[i];
+                ili9341_tx_wait(tx);
+                chunk = min(len, ili9341_chunk(item, item->tx_size) / 2);
+                item->convert(tx->buf, buffer, chunk);
+                if (ili9341_tx_queue(item, tx, chunk * 2))
+                        break;
+                buffer += chunk * 2;
+                len -= chunk;
+                i = (i + 1) % ILI9341_TX_BUFS;
+        }
+
+        //The next command toggles DC, nothing may be left on the bus.
+        for (i = 0; i < ILI9341_TX_BUFS; i++)
+                ili9341_tx_wait(&item->tx[i]);
+}
+
+//Hand a span of the DMA framebuffer to the controller as it is. Shifted out
+//as 16-bit words, native-endian RGB565 arrives in the big-endian order the
+//panel wants, so there's nothing to convert.
+static void ili9341_send_dma(struct ili9341 *item, unsigned int offset,
+                             unsigned int len)
+{
+        struct spi_transfer t;
+        struct spi_message m;
+        unsigned int chunk;
+        int ret;
+
+        while (len) {
+                chunk = min(len, ili9341_chunk(item, len));
+                dma_sync_single_for_device(item->dma_dev,
+                                           item->fb_dma_addr + offset,
+                                           chunk, DMA_TO_DEVICE);
+
+                memset(&t, 0, sizeof(t));
+                t.tx_buf = item->info->screen_base + offset;
+                t.tx_dma = item->fb_dma_addr + offset;
+                t.len = chunk;
+                t.speed_hz = item->speed_hz;
+                t.bits_per_word = 16;
+                spi_message_init(&m);
+                m.is_dma_mapped = 1;
+                spi_message_add_tail(&t, &m);
+
+                ret = spi_sync(item->spi, &m);
+                if (ret) {
+                        dev_err(item->dev, "%s: spi_sync failed: %d\n",
+                                __func__, ret);
+                        return;
+                }
+                offset += chunk;
+                len -= chunk;
+        }
+}
+
+//Take the overlays as they're set now for this flush. Images are only
+//copied when they've changed.
+static void ili9341_overlay_snapshot(struct ili9341 *item)
+{
+        unsigned int cpp = item->info->var.bits_per_pixel / 8;
+        struct ili9341_overlay *s, *f;
+        void *pixels;
+        unsigned int i;
+
+        spin_lock(&item->sprite_lock);
+        for (i = 0; i < ILI9341_SPRITES; i++) {
+                s = &item->sprites[i];
+                f = &item->flush_sprites[i];
+                if (f->gen != s->gen)
+                        memcpy(f->pixels, s->pixels,
+                               s->width * s->height * cpp);
+                pixels = f->pixels;
+                *f = *s;
+                f->pixels = pixels;
+        }
+        spin_unlock(&item->sprite_lock);
+}
+
+//Whether any overlay covers part of the rectangle w x h at (x, y).
+static bool ili9341_overlay_hit(struct ili9341 *item, int x, int y,
+                                unsigned int w, unsigned int h)
+{
+        const struct ili9341_overlay *f;
+        unsigned int i;
+
+        for (i = 0; i < ILI9341_SPRITES; i++) {
+                f = &item->flush_sprites[i];
+                if (f->visible && f->x < x + (int)w &&
+                    x < f->x + (int)f->width &&
+                    f->y < y + (int)h && y < f->y + (int)f->height)
+                        return true;
+        }
+        return false;
+}
+
+//Framebuffer row y as the panel should show it: the row itself, or a copy
+//in overlay_row with the overlays that cross it drawn on top.
+static const void *ili9341_overlay_row(struct ili9341 *item, unsigned int y)
+{
+        unsigned int xres = item->info->var.xres;
+        unsigned int cpp = item->info->var.bits_per_pixel / 8;
+        const void *row = item->info->screen_base +
+                          y * item->info->fix.line_length;
+        const struct ili9341_overlay *f;
+        const void *src;
+        unsigned int i, n;
+        int x0, x1, x;
+        u32 pixel;
+
+        for (i = ILI9341_SPRITES; i--; ) {
+                f = &item->flush_sprites[i];
+                if (!f->visible || (int)y < f->y ||
+                    (int)y >= f->y + (int)f->height)
+                        continue;
+                x0 = max(f->x, 0);
+                x1 = min(f->x + (int)f->width, (int)xres);
+                if (x0 >= x1)
+                        continue;
+                if (row != item->overlay_row) {
+                        memcpy(item->overlay_row, row, xres * cpp);
+                        row = item->overlay_row;
+                }
+                src = f->pixels + ((y - f->y) * f->width + x0 - f->x) * cpp;
+                for (x = x0, n = 0; x < x1; x++, n++) {
+                        pixel = cpp == 4 ? ((const u32 *)src)[n] :
+                                           ((const u16 *)src)[n];
+                        if (pixel == f->key)
+                                continue;
+                        if (cpp == 4)
+                                ((u32 *)item->overlay_row)[x] = pixel;
+                        else
+                                ((u16 *)item->overlay_row)[x] = pixel;
+                }
+        }
+
+        return row;
+}
+
+//Setting up a window takes eleven single byte spi_sync() calls, which on
+//the PiTFT costs about as much as streaming a few hundred pixels. Unchanged
+//gaps shorter than that are cheaper to send along than to skip.
+//ili9341_calibrate() replaces this with what the bus actually does.
+#define ILI9341_WINDOW_COST		256
+
+//Empty windows timed by ili9341_calibrate().
+#define ILI9341_CAL_WINDOWS		16
+
+//What sending a flush run by run would take, found by a first pass over the
+//damage that only compares. Adjacent full rows count as one window, like
+//ili9341_send_run() sends them. The bounding box is [x0, x1) x [y0, y1).
+struct ili9341_plan {
+        unsigned int windows;
+        unsigned int pixels;
+        unsigned int next_full;
+        unsigned int x0;
+        unsigned int x1;
+        unsigned int y0;
+        unsigned int y1;
+};
+
+//Rows that changed across the whole width, waiting to go out as one window.
+//With plan set, runs are only accounted for there and nothing is sent.
+struct ili9341_batch {
+        unsigned int y;
+        unsigned int rows;
+        struct ili9341_plan *plan;
+};
+
+//Send width x rows pixels at (x, y) from the shadow. Full width windows
+//are contiguous and go out in one piece, narrower ones a row at a time
+//into the same window. With a DMA framebuffer they go out of the
+//framebuffer instead, which the shadow has just been brought up to date
+//with, unless an overlay covers part of them there.
+static void ili9341_send_window(struct ili9341 *item, unsigned int x,
+                                unsigned int y, unsigned int width,
+                                unsigned int rows)
+{
+        unsigned int cpp = item->info->var.bits_per_pixel / 8;
+        unsigned int offset = y * item->info->fix.line_length + x * cpp;
+        int dma = item->fb_dma && !ili9341_overlay_hit(item, x, y, width, rows);
+
+        ili9341_set_window(item, x, y, x + width - 1, y + rows - 1);
+        if (width == item->info->var.xres) {
+                width *= rows;
+                rows = 1;
+        }
+        for (; rows; rows--, offset += item->info->fix.line_length) {
+                if (dma)
+                        ili9341_send_dma(item, offset, width * cpp);
+                else
+                        ili9341_send_pixels(item, item->shadow + offset,
+                                            width);
+        }
+}
+
+static void ili9341_send_batch(struct ili9341 *item, struct ili9341_batch *batch)
+{
+        if (batch->rows)
+                ili9341_send_window(item, 0, batch->y, item->info->var.xres,
+                                    batch->rows);
+        batch->rows = 0;
+}
+
+static void ili9341_plan_run(struct ili9341 *item, struct ili9341_plan *plan,
+                             unsigned int y, unsigned int start,
+                             unsigned int end)
+{
+        bool full = start == 0 && end == item->info->var.xres;
+
+        if (!plan->pixels) {
+                plan->x0 = start;
+                plan->x1 = end;
+                plan->y0 = y;
+        }
+        plan->x0 = min(plan->x0, start);
+        plan->x1 = max(plan->x1, end);
+        plan->y1 = y + 1;
+        plan->pixels += end - start;
+        if (!full || plan->next_full != y)
+                plan->windows++;
+        plan->next_full = full ? y + 1 : UINT_MAX;
+}
+
+//One window over the bounding box resends the unchanged pixels inside it,
+//run by run every window is paid for. Take whichever moves less; a box that
+//covers the whole frame is a plain full frame update.
+static bool ili9341_plan_bbox(struct ili9341 *item, struct ili9341_plan *plan)
+{
+        u64 runs = (u64)plan->windows * item->window_cost + plan->pixels;
+        u64 bbox = item->window_cost +
+                   (u64)(plan->x1 - plan->x0) * (plan->y1 - plan->y0);
+
+        return plan->windows > 1 && bbox < runs;
+}
+
+//Bring the bounding box into the shadow and send it as one window.
+static void ili9341_send_bbox(struct ili9341 *item, struct ili9341_plan *plan)
+{
+        unsigned int cpp = item->info->var.bits_per_pixel / 8;
+        unsigned int offset, y;
+
+        for (y = plan->y0; y < plan->y1; y++) {
+                offset = y * item->info->fix.line_length + plan->x0 * cpp;
+                memcpy(item->shadow + offset,
+                       ili9341_overlay_row(item, y) + plan->x0 * cpp,
+                       (plan->x1 - plan->x0) * cpp);
+        }
+        ili9341_send_window(item, plan->x0, plan->y0, plan->x1 - plan->x0,
+                            plan->y1 - plan->y0);
+}
+
+//Take over the changed run [start, end) of row y, composed in row, into
+//the shadow and send it. Full rows are held back so adjacent ones share a
+//single window.
+static void ili9341_send_run(struct ili9341 *item, unsigned int y,
+                             const void *row, unsigned int start,
+                             unsigned int end, struct ili9341_batch *batch)
+{
+        unsigned int cpp = item->info->var.bits_per_pixel / 8;
+        unsigned int offset = y * item->info->fix.line_length + start * cpp;
+
+        if (batch->plan) {
+                ili9341_plan_run(item, batch->plan, y, start, end);
+                return;
+        }
+
+        memcpy(item->shadow + offset, row + start * cpp, (end - start) * cpp);
+
+        if (start == 0 && end == item->info->var.xres) {
+                if (batch->rows && batch->y + batch->rows == y) {
+                        batch->rows++;
+                        return;
+                }
+                ili9341_send_batch(item, batch);
+                batch->y = y;
+                batch->rows = 1;
+                return;
+        }
+        ili9341_send_window(item, start, y, end - start, 1);
+}
+
+//Compare row y with the shadow a word at a time and send only the runs of
+//pixels that changed. Runs separated by fewer unchanged pixels than a window
+//costs are merged and sent together.
+static void ili9341_flush_row(struct ili9341 *item, unsigned int y,
+                              struct ili9341_batch *batch)
+{
+        unsigned int xres = item->info->var.xres;
+        unsigned int cpp = item->info->var.bits_per_pixel / 8;
+        unsigned int offset = y * item->info->fix.line_length;
+        const u32 *fb = ili9341_overlay_row(item, y);
+        const u32 *shadow = item->shadow + offset;
+        unsigned int words = DIV_ROUND_UP(xres * cpp, 4);
+        unsigned int gap = item->window_cost * cpp / 4;
+        unsigned int w, start = 0, end = 0;
+
+        if (!memcmp(fb, shadow, xres * cpp))
+                return;
+
+        for (w = 0; w < words; w++) {
+                if (!(fb[w] ^ shadow[w]))
+                        continue;
+                if (end && w - end > gap) {
+                        ili9341_send_run(item, y, fb, start * 4 / cpp,
+                                         end * 4 / cpp, batch);
+                        end = 0;
+                }
+                if (!end)
+                        start = w;
+                end = w + 1;
+        }
+        if (end)
+                ili9341_send_run(item, y, fb, start * 4 / cpp,
+                                 min(end * 4 / cpp, xres), batch);
+}
+
+//Rows shared by two dirty pages are diffed once.
+static void ili9341_flush_pages(struct ili9341 *item, unsigned long *pages,
+                                struct ili9341_batch *batch)
+{
+        unsigned int xres = item->info->var.xres;
+        unsigned int i, y, last, next = 0;
+
+        for_each_set_bit(i, pages, item->pages_count) {
+                y = max_t(unsigned int, item->pages[i].y, next);
+                last = (item->pages[i].y * xres + item->pages[i].x +
+                        item->pages[i].len - 1) / xres;
+                for (; y <= last; y++)
+                        ili9341_flush_row(item, y, batch);
+                next = last + 1;
+        }
+}
+
+//The 16 bpp expansion sys_imageblit() did, into the shadow.
+static void ili9341_glyph_to_shadow(struct ili9341 *item,
+                                    const struct ili9341_glyph *glyph)
+{
+        unsigned int line_length = item->info->fix.line_length;
+        u16 *dst = item->shadow + glyph->y * line_length + glyph->x * 2;
+        unsigned int r, b;
+
+        for (r = 0; r < glyph->rows; r++, dst += line_length / 2)
+                for (b = 0; b < 8; b++)
+                        dst[b] = glyph->bits[r] & (0x80 >> b) ?
+                                 glyph->fg : glyph->bg;
+}
+
+//Adjacent cells on a text line are copied out of the shadow into
+//glyph_line and sent with one window and one ili9341_send_pixels().
+static void ili9341_flush_glyphs(struct ili9341 *item)
+{
+        unsigned int xres = item->info->var.xres;
+        unsigned int yres = item->info->var.yres;
+        unsigned int line_length = item->info->fix.line_length;
+        unsigned int head, tail = item->glyph_tail;
+        const struct ili9341_glyph *first, *glyph;
+        unsigned int cells, r, width;
+        const void *src;
+
+        if (!item->glyph_ring)
+                return;
+        head = READ_ONCE(item->glyph_head);
+        //Read the cells only after the head that publishes them.
+        smp_rmb();
+
+        while (tail != head) {
+                first = &item->glyph_ring[tail % ILI9341_GLYPH_RING];
+                //Queued before a mode change that left it off screen.
+                if (first->x + 8 > xres || first->y + first->rows > yres) {
+                        tail++;
+                        continue;
+                }
+
+                for (cells = 0; tail != head; tail++, cells++) {
+                        glyph = &item->glyph_ring[tail % ILI9341_GLYPH_RING];
+                        if (glyph->y != first->y ||
+                            glyph->rows != first->rows ||
+                            glyph->x != first->x + cells * 8 ||
+                            glyph->x + 8 > xres)
+                                break;
+                        ili9341_glyph_to_shadow(item, glyph);
+                }
+
+                width = cells * 8;
+                src = item->shadow + first->y * line_length + first->x * 2;
+                for (r = 0; r < first->rows; r++, src += line_length)
+                        memcpy(item->glyph_line + r * width, src, width * 2);
+                ili9341_set_window(item, first->x, first->y,
+                                   first->x + width - 1,
+                                   first->y + first->rows - 1);
+                ili9341_send_pixels(item, item->glyph_line,
+                                    width * first->rows);
+
+                //Text under an overlay has just covered it; have the diff
+                //put it back on top.
+                if (ili9341_overlay_hit(item, first->x, first->y, width,
+                                        first->rows))
+                        for (r = item->row_first_page[first->y];
+                             r <= item->row_last_page[first->y +
+                                                      first->rows - 1]; r++)
+                                set_bit(r, item->flush_pages);
+        }
+
+        //Done reading the cells before imageblit may reuse them.
+        smp_mb();
+        WRITE_ONCE(item->glyph_tail, tail);
+}
+
+//Plan from a first pass over the pages, then send one bounding box or the
+//runs a second pass batches up.
+static void ili9341_flush_set(struct ili9341 *item, unsigned long *pages)
+{
+        struct ili9341_plan plan = { .next_full = UINT_MAX };
+        struct ili9341_batch batch = { .plan = &plan };
+
+        ili9341_flush_pages(item, pages, &batch);
+        batch.plan = NULL;
+        if (ili9341_plan_bbox(item, &plan)) {
+                ili9341_send_bbox(item, &plan);
+        } else if (plan.pixels) {
+                ili9341_flush_pages(item, pages, &batch);
+                ili9341_send_batch(item, &batch);
+        }
+}
+
+//flush_work, queued by the timer and by deferred io.
+static void ili9341_flush(struct kthread_work *work)
+{
+        struct ili9341 *item = container_of(work, struct ili9341, flush_work);
+        unsigned int i;
+
+        //Too soon for max_fps: retry at next_flush, unless flush_stop()
+        //has begun.
+        if (item->max_fps && time_before(jiffies, item->next_flush)) {
+                if (!item->flush_stopping)
+                        mod_timer(&item->flush_timer, item->next_flush);
+                return;
+        }
+        if (item->max_fps)
+                item->next_flush = jiffies + DIV_ROUND_UP(HZ, item->max_fps);
+
+        item->flush_started++;
+        atomic_set(&item->pending, 0);
+
+        //Pages marked after the xchg() wait in dirty for the next flush.
+        //ILI9341IO_SET_PRIORITY racing with this only reorders pages.
+        for (i = 0; i < BITS_TO_LONGS(item->pages_count); i++) {
+                item->flush_pages[i] = xchg(&item->dirty[i], 0);
+                item->flush_urgent[i] = item->flush_pages[i] &
+                                        item->prio_pages[i];
+                item->flush_pages[i] &= ~item->flush_urgent[i];
+        }
+
+        ili9341_overlay_snapshot(item);
+        //Before the diff, so pages drawn over a cell go out on top of it.
+        ili9341_flush_glyphs(item);
+        ili9341_flush_set(item, item->flush_urgent);
+        ili9341_flush_set(item, item->flush_pages);
+
+        spin_lock(&item->flush_lock);
+        item->flush_done_ns = ktime_to_ns(ktime_get());
+        item->flush_seq++;
+        spin_unlock(&item->flush_lock);
+        wake_up_all(&item->flush_wq);
+}
+
+//Called from the deferred io work with the pages written through mmap; the
+//bus transfer itself is left to the flush thread.
 static void ili9341_update(struct fb_info *info, struct list_head *pagelist)
 {
-    struct ili9341 *item = (struct ili9341 *)info->par;
-    struct page *page;
-    int i, j;
-
-    //Copy all pages.
-    for (i=0; i<item->pages_count; i++) {
-    		if(i == item->pages_count-1) {
-    			memcpy(item->tmpbuf, item->pages[i].buffer, PAGE_SIZE/2);
-    			for (j=0; j<PAGE_SIZE/2; j++) {
-    				item->tmpbuf_be[j] = htons(item->tmpbuf[j]);
-    			}
-    			ili9341_write_spi(item, item->tmpbuf_be, PAGE_SIZE/2);
-    		}
-            else {
-            	memcpy(item->tmpbuf, item->pages[i].buffer, PAGE_SIZE);
-    			for (j=0; j<PAGE_SIZE; j++) {
-    				item->tmpbuf_be[j] = htons(item->tmpbuf[j]);
-    			}
-            	ili9341_write_spi(item, item->tmpbuf_be, PAGE_SIZE);
-            }
-    }
+        struct ili9341 *item = (struct ili9341 *)info->par;
+        struct page *page;
+        int superseded = 0;
+
+        list_for_each_entry(page, pagelist, lru) {
+                superseded |= ili9341_mark_page(item, page->index);
+        }
+        ili9341_count_frame(item, superseded);
+
+        queue_kthread_work(&item->flush_worker, &item->flush_work);
+}
+
+static int ili9341_set_flush_prio(struct ili9341 *item, int prio)
+{
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 9, 0)
+        struct sched_param param = { .sched_priority = prio };
+#endif
+        int ret;
+
+        if (prio < 0 || prio >= MAX_RT_PRIO)
+                return -EINVAL;
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 9, 0)
+        ret = sched_setscheduler(item->flush_thread,
+                                 prio ? SCHED_FIFO : SCHED_NORMAL, &param);
+#else
+        //Modules can't pick a FIFO priority any more, only ask for one;
+        //sched_set_fifo() always gives MAX_RT_PRIO / 2, so keep that.
+        ret = 0;
+        if (prio) {
+                sched_set_fifo(item->flush_thread);
+                prio = MAX_RT_PRIO / 2;
+        } else {
+                sched_set_normal(item->flush_thread, 0);
+        }
+#endif
+        if (ret) {
+                dev_err(item->dev, "%s: unable to set priority %d\n",
+                        __func__, prio);
+                return ret;
+        }
+        item->flush_prio = prio;
+
+        return 0;
+}
+
+static int ili9341_flush_start(struct ili9341 *item)
+{
+        init_kthread_worker(&item->flush_worker);
+        init_kthread_work(&item->flush_work, ili9341_flush);
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 15, 0)
+        setup_timer(&item->flush_timer, ili9341_flush_timer,
+                    (unsigned long)item);
+#else
+        timer_setup(&item->flush_timer, ili9341_flush_timer, 0);
+#endif
+
+        item->flush_thread = kthread_create(kthread_worker_fn,
+                                            &item->flush_worker,
+                                            "ili9341/%s", dev_name(item->dev));
+        if (IS_ERR(item->flush_thread)) {
+                dev_err(item->dev, "%s: unable to create flush thread\n",
+                        __func__);
+                return PTR_ERR(item->flush_thread);
+        }
+
+        if (flush_cpu >= 0) {
+                if (flush_cpu < nr_cpu_ids && cpu_online(flush_cpu))
+                        kthread_bind(item->flush_thread, flush_cpu);
+                else
+                        dev_warn(item->dev, "%s: cpu %d is not online\n",
+                                 __func__, flush_cpu);
+        }
+        ili9341_set_flush_prio(item, flush_prio);
+        wake_up_process(item->flush_thread);
+
+        return 0;
+}
+
+static void ili9341_flush_stop(struct ili9341 *item)
+{
+        //The second del_timer_sync() is for a flush that read
+        //flush_stopping just before the store.
+        item->flush_stopping = 1;
+        smp_mb();
+        del_timer_sync(&item->flush_timer);
+        flush_kthread_worker(&item->flush_worker);
+        del_timer_sync(&item->flush_timer);
+        kthread_stop(item->flush_thread);
+}
+
+static ssize_t ili9341_flush_prio_show(struct device *dev,
+                                       struct device_attribute *attr, char *buf)
+{
+        struct ili9341 *item = dev_get_drvdata(dev);
+
+        return sprintf(buf, "%d\n", item->flush_prio);
+}
+
+static ssize_t ili9341_flush_prio_store(struct device *dev,
+                                        struct device_attribute *attr,
+                                        const char *buf, size_t count)
+{
+        struct ili9341 *item = dev_get_drvdata(dev);
+        unsigned int prio;
+        int ret;
+
+        ret = kstrtouint(buf, 10, &prio);
+        if (ret)
+                return ret;
+        ret = ili9341_set_flush_prio(item, prio);
+
+        return ret ? ret : count;
+}
+
+static DEVICE_ATTR(flush_prio, 0644, ili9341_flush_prio_show,
+                   ili9341_flush_prio_store);
+
+//Time a full frame and a burst of empty windows on the bus, and express the
+//cost of a window in pixels for the flush planner. The frame is what the
+//panel already shows, so this can run whenever the bus settings change.
+static void ili9341_calibrate(struct ili9341 *item)
+{
+        unsigned int pixels = item->info->var.xres * item->info->var.yres;
+        ktime_t t0, t1, t2;
+        u64 frame_ns, window_ns;
+        int i;
+
+        t0 = ktime_get();
+        ili9341_send_window(item, 0, 0, item->info->var.xres,
+                            item->info->var.yres);
+        t1 = ktime_get();
+        for (i = 0; i < ILI9341_CAL_WINDOWS; i++)
+                ili9341_set_window(item, 0, 0, 0, 0);
+        t2 = ktime_get();
+
+        frame_ns = ktime_to_ns(ktime_sub(t1, t0));
+        window_ns = ktime_to_ns(ktime_sub(t2, t1));
+        if (!frame_ns || !window_ns)
+                return;
+        item->window_cost = clamp_t(u64, div64_u64(window_ns * pixels,
+                                        frame_ns * ILI9341_CAL_WINDOWS),
+                                    1, pixels);
+        dev_info(item->dev, "window costs %u pixels\n", item->window_cost);
+}
+
+//Recalibrates on the flush thread, between flushes.
+static void ili9341_calibrate_work(struct kthread_work *work)
+{
+        struct ili9341 *item = container_of(work, struct ili9341,
+                                            calibrate_work);
+
+        ili9341_calibrate(item);
+}
+
+static ssize_t ili9341_spi_speed_hz_show(struct device *dev,
+                                         struct device_attribute *attr,
+                                         char *buf)
+{
+        struct ili9341 *item = dev_get_drvdata(dev);
+
+        return sprintf(buf, "%u\n", item->speed_hz ? item->speed_hz :
+                       item->spi->max_speed_hz);
+}
+
+static ssize_t ili9341_spi_speed_hz_store(struct device *dev,
+                                          struct device_attribute *attr,
+                                          const char *buf, size_t count)
+{
+        struct ili9341 *item = dev_get_drvdata(dev);
+        unsigned int speed;
+        int ret;
+
+        ret = kstrtouint(buf, 10, &speed);
+        if (ret)
+                return ret;
+        item->speed_hz = speed;
+        queue_kthread_work(&item->flush_worker, &item->calibrate_work);
+
+        return count;
+}
+
+static DEVICE_ATTR(spi_speed_hz, 0644, ili9341_spi_speed_hz_show,
+                   ili9341_spi_speed_hz_store);
+
+static ssize_t ili9341_chunk_size_show(struct device *dev,
+                                       struct device_attribute *attr, char *buf)
+{
+        struct ili9341 *item = dev_get_drvdata(dev);
+
+        return sprintf(buf, "%u\n", ili9341_chunk(item, UINT_MAX));
+}
+
+static ssize_t ili9341_chunk_size_store(struct device *dev,
+                                        struct device_attribute *attr,
+                                        const char *buf, size_t count)
+{
+        struct ili9341 *item = dev_get_drvdata(dev);
+        unsigned int size;
+        int ret;
+
+        ret = kstrtouint(buf, 10, &size);
+        if (ret)
+                return ret;
+        //0 goes back to the controller's limit.
+        if (size == 1)
+                return -EINVAL;
+        item->chunk_size = size;
+        queue_kthread_work(&item->flush_worker, &item->calibrate_work);
+
+        return count;
+}
+
+static DEVICE_ATTR(chunk_size, 0644, ili9341_chunk_size_show,
+                   ili9341_chunk_size_store);
+
+static ssize_t ili9341_max_fps_show(struct device *dev,
+                                    struct device_attribute *attr, char *buf)
+{
+        struct ili9341 *item = dev_get_drvdata(dev);
+
+        return sprintf(buf, "%u\n", item->max_fps);
+}
+
+static ssize_t ili9341_max_fps_store(struct device *dev,
+                                     struct device_attribute *attr,
+                                     const char *buf, size_t count)
+{
+        struct ili9341 *item = dev_get_drvdata(dev);
+        unsigned int fps;
+        int ret;
+
+        ret = kstrtouint(buf, 10, &fps);
+        if (ret)
+                return ret;
+        if (fps > HZ)
+                return -EINVAL;
+        item->max_fps = fps;
+
+        return count;
+}
+
+static DEVICE_ATTR(max_fps, 0644, ili9341_max_fps_show,
+                   ili9341_max_fps_store);
+
+//Updates handed in, flushes done, updates that joined a pending flush and
+//updates that overwrote damage before it was sent.
+static ssize_t ili9341_flush_stats_show(struct device *dev,
+                                        struct device_attribute *attr,
+                                        char *buf)
+{
+        struct ili9341 *item = dev_get_drvdata(dev);
+
+        return sprintf(buf, "%u %u %u %u\n", atomic_read(&item->frames),
+                       item->flush_seq, atomic_read(&item->coalesced),
+                       atomic_read(&item->dropped));
+}
+
+static DEVICE_ATTR(flush_stats, 0444, ili9341_flush_stats_show, NULL);
+
+//Memory reads (0x2e) return 18-bit pixels whatever the write format is: one
+//byte per color, value in the top six bits. Reads are specified a lot slower
+//than writes, so they're done at a fixed safe clock and errors point at the
+//write side.
+#define ILI9341_READ_HZ			6000000
+#define ILI9341_SELFTEST_PASSES		8
+
+//Compare the panel's memory with the shadow, row by row. Runs on the flush
+//thread, so it can't race with a flush using the bus.
+static void ili9341_verify(struct kthread_work *work)
+{
+        struct ili9341 *item = container_of(work, struct ili9341, verify_work);
+        struct ili9341_selftest *st = &item->selftest;
+        unsigned int xres = item->info->var.xres;
+        u32 speed = item->speed_hz ? item->speed_hz : item->spi->max_speed_hz;
+        const u16 *pixel;
+        unsigned int x, y;
+        u8 *buf, *rgb;
+
+        buf = kmalloc(xres * 3, GFP_KERNEL);
+        if (!buf) {
+                st->ret = -ENOMEM;
+                return;
+        }
+        speed = min_t(u32, speed, ILI9341_READ_HZ);
+
+        st->ret = ili9341_read_reg(item, 0xd3, st->id, 3, 8, speed);
+        if (!st->ret)
+                st->ret = ili9341_read_reg(item, 0x04, st->status, 3, 1,
+                                           speed);
+        if (st->ret) {
+                kfree(buf);
+                return;
+        }
+
+        for (y = 0; y < item->info->var.yres; y++) {
+                ili9341_set_window(item, 0, y, xres - 1, y);
+                st->ret = ili9341_read_reg(item, 0x2e, buf, xres * 3, 8, speed);
+                if (st->ret)
+                        break;
+
+                pixel = item->shadow + y * item->info->fix.line_length;
+                rgb = buf;
+                for (x = 0; x < xres; x++, pixel++, rgb += 3) {
+                        if ((rgb[0] & 0xf8) != ((*pixel >> 8) & 0xf8) ||
+                            (rgb[1] & 0xfc) != ((*pixel >> 3) & 0xfc) ||
+                            (rgb[2] & 0xf8) != ((*pixel << 3) & 0xf8))
+                                st->errors++;
+                }
+                st->pixels += xres;
+        }
+
+        kfree(buf);
+}
+
+//Frames that differ from the previous one in nearly every word, so the diff
+//can't skip much and the flush time is a fair throughput figure.
+static void ili9341_selftest_fill(struct ili9341 *item, unsigned int pass)
+{
+        u16 *pixel = (u16 *)item->info->screen_base;
+        unsigned int i, count = item->info->var.xres * item->info->var.yres;
+
+        for (i = 0; i < count; i++)
+                pixel[i] = (i * 0x9e37 + pass * 0x5bd1) ^ (i >> 5);
+}
+
+static int ili9341_selftest_run(struct ili9341 *item)
+{
+        struct ili9341_selftest *st = &item->selftest;
+        unsigned int xres = item->info->var.xres;
+        unsigned int yres = item->info->var.yres;
+        unsigned int pass, x, y, fps;
+        void *saved;
+        ktime_t start;
+        u16 *pixel;
+
+        saved = vmalloc(item->info->fix.smem_len);
+        if (!saved)
+                return -ENOMEM;
+        memcpy(saved, (void __force *)item->info->screen_base,
+               item->info->fix.smem_len);
+
+        //Every pass has to be flushed right away to be timed and checked.
+        fps = item->max_fps;
+        item->max_fps = 0;
+
+        memset(st, 0, sizeof(*st));
+        for (pass = 0; pass <= ILI9341_SELFTEST_PASSES && !st->ret; pass++) {
+                if (pass < ILI9341_SELFTEST_PASSES) {
+                        ili9341_selftest_fill(item, pass);
+                        ili9341_mark_rows(item, 0, yres);
+                } else {
+                        //Last pass: a checkerboard in the middle only, to
+                        //check partial updates land where they belong.
+                        for (y = yres / 4; y < yres * 3 / 4; y++) {
+                                pixel = (u16 *)(item->info->screen_base +
+                                        y * item->info->fix.line_length);
+                                for (x = xres / 4; x < xres * 3 / 4; x++)
+                                        pixel[x] = ((x ^ y) & 8) ? 0xffff : 0;
+                        }
+                        ili9341_mark_rows(item, yres / 4, yres / 2);
+                }
+
+                start = ktime_get();
+                queue_kthread_work(&item->flush_worker, &item->flush_work);
+                flush_kthread_worker(&item->flush_worker);
+                st->flush_ns += ktime_to_ns(ktime_sub(ktime_get(), start));
+                st->frames++;
+
+                queue_kthread_work(&item->flush_worker, &item->verify_work);
+                flush_kthread_worker(&item->flush_worker);
+        }
+
+        memcpy((void __force *)item->info->screen_base, saved,
+               item->info->fix.smem_len);
+        vfree(saved);
+        ili9341_mark_rows(item, 0, yres);
+        queue_kthread_work(&item->flush_worker, &item->flush_work);
+        item->max_fps = fps;
+
+        return st->ret;
+}
+
+static int ili9341_selftest_show(struct seq_file *m, void *v)
+{
+        struct ili9341 *item = m->private;
+        struct ili9341_selftest *st = &item->selftest;
+        u64 bytes, us;
+
+        mutex_lock(&item->selftest_lock);
+        if (!st->frames) {
+                seq_printf(m, "not run, write 1 to start\n");
+        } else {
+                bytes = (u64)st->frames * item->info->var.xres *
+                        item->info->var.yres * 2;
+                us = div_u64(st->flush_ns, 1000) ? : 1;
+                seq_printf(m, "result: %s (%d)\n",
+                           st->ret ? "failed" : st->errors ? "errors" : "ok",
+                           st->ret);
+                seq_printf(m, "speed_hz: %u\n", item->speed_hz ?
+                           item->speed_hz : item->spi->max_speed_hz);
+                seq_printf(m, "frames: %u in %llu us, %llu KiB/s\n",
+                           st->frames, (unsigned long long)us,
+                           (unsigned long long)div64_u64(bytes * 1000000,
+                                                         us * 1024));
+                seq_printf(m, "pixels: %lu checked, %lu wrong\n",
+                           st->pixels, st->errors);
+                seq_printf(m, "id: %02x %02x %02x, status: %02x %02x %02x\n",
+                           st->id[0], st->id[1], st->id[2],
+                           st->status[0], st->status[1], st->status[2]);
+        }
+        mutex_unlock(&item->selftest_lock);
+
+        return 0;
+}
+
+static int ili9341_selftest_open(struct inode *inode, struct file *file)
+{
+        return single_open(file, ili9341_selftest_show, inode->i_private);
+}
+
+static ssize_t ili9341_selftest_write(struct file *file,
+                                      const char __user *buf, size_t count,
+                                      loff_t *ppos)
+{
+        struct seq_file *m = file->private_data;
+        struct ili9341 *item = m->private;
+        int ret;
+
+        mutex_lock(&item->selftest_lock);
+        ret = ili9341_selftest_run(item);
+        mutex_unlock(&item->selftest_lock);
+
+        return ret ? ret : count;
+}
+
+static const struct file_operations ili9341_selftest_fops = {
+        .owner = THIS_MODULE,
+        .open = ili9341_selftest_open,
+        .read = seq_read,
+        .write = ili9341_selftest_write,
+        .llseek = seq_lseek,
+        .release = single_release,
+};
+
+static void ili9341_debugfs_init(struct ili9341 *item)
+{
+        char name[32];
+
+        snprintf(name, sizeof(name), "ili9341-%s", dev_name(item->dev));
+        item->debugfs = debugfs_create_dir(name, NULL);
+        if (IS_ERR_OR_NULL(item->debugfs)) {
+                item->debugfs = NULL;
+                return;
+        }
+        debugfs_create_file("selftest", 0600, item->debugfs, item,
+                            &ili9341_selftest_fops);
 }
 
 static inline __u32 CNVT_TOHW(__u32 val, __u32 width)
@@ -595,9 +2142,59 @@ static void ili9341_fillrect(struct fb_info *p, const struct fb_fillrect *rect)
 
 }
 
+//Queue console text for the flush thread, one cell per 8 pixel column.
+//Anything else, and text that doesn't fit into the ring, goes through the
+//pages instead.
+static bool ili9341_queue_glyphs(struct ili9341 *item,
+                                 const struct fb_image *image)
+{
+        struct fb_info *info = item->info;
+        const u32 *pal = info->pseudo_palette;
+        unsigned int cells = image->width / 8;
+        unsigned int head = item->glyph_head;
+        struct ili9341_glyph *glyph;
+        unsigned int c, r;
+
+        if (!item->glyph_ring || image->depth != 1 ||
+            !cells || image->width % 8 ||
+            !image->height || image->height > ILI9341_GLYPH_ROWS ||
+            info->fix.visual != FB_VISUAL_TRUECOLOR ||
+            image->fg_color >= 16 || image->bg_color >= 16 ||
+            image->dx + image->width > info->var.xres ||
+            image->dy + image->height > info->var.yres)
+                return false;
+        if (head - READ_ONCE(item->glyph_tail) + cells > ILI9341_GLYPH_RING)
+                return false;
+
+        for (c = 0; c < cells; c++, head++) {
+                glyph = &item->glyph_ring[head % ILI9341_GLYPH_RING];
+                glyph->x = image->dx + c * 8;
+                glyph->y = image->dy;
+                glyph->rows = image->height;
+                glyph->fg = pal[image->fg_color];
+                glyph->bg = pal[image->bg_color];
+                for (r = 0; r < image->height; r++)
+                        glyph->bits[r] = image->data[r * cells + c];
+        }
+        //The flush thread sees the cells before the head that covers them.
+        smp_wmb();
+        WRITE_ONCE(item->glyph_head, head);
+
+        return true;
+}
+
 static void ili9341_imageblit(struct fb_info *p, const struct fb_image *image)
 {
+        struct ili9341 *item = (struct ili9341 *)p->par;
+
         sys_imageblit(p, image);
+        if (p->fbdefio && ili9341_queue_glyphs(item, image)) {
+                ili9341_count_frame(item, 0);
+                ili9341_schedule_flush_in(item,
+                                          ili9341_rows_delay(item, image->dy,
+                                                             image->height));
+                return;
+        }
         ili9341_touch(p, image->dx, image->dy, image->width, image->height);
 }
 
@@ -617,7 +2214,241 @@ static ssize_t ili9341_write(struct fb_info *p, const char __user *buf,
         return res;
 }
 
-static struct fb_ops ili9341_fbops = {
+static int ili9341_damage(struct ili9341 *item, void __user *argp)
+{
+        struct ili9341_damage damage;
+        struct ili9341_damage_rect rect;
+        const struct ili9341_damage_rect __user *rects;
+        unsigned long delay = item->defio.delay;
+        unsigned int i, h;
+        int superseded = 0;
+
+        if (copy_from_user(&damage, argp, sizeof(damage)))
+                return -EFAULT;
+        if (damage.count > ILI9341_DAMAGE_MAX_RECTS)
+                return -EINVAL;
+
+        rects = (const struct ili9341_damage_rect __user *)
+                (unsigned long)damage.rects;
+        for (i = 0; i < damage.count; i++) {
+                if (copy_from_user(&rect, &rects[i], sizeof(rect)))
+                        return -EFAULT;
+                if (rect.y >= item->info->var.yres || !rect.h)
+                        continue;
+                h = min_t(unsigned int, rect.h, item->info->var.yres - rect.y);
+                superseded |= ili9341_mark_rows(item, rect.y, h);
+                delay = min(delay, ili9341_rows_delay(item, rect.y, h));
+        }
+        ili9341_count_frame(item, superseded);
+
+        if (damage.flags & ILI9341_DAMAGE_FLUSH)
+                queue_kthread_work(&item->flush_worker, &item->flush_work);
+        else
+                ili9341_schedule_flush_in(item, delay);
+
+        return 0;
+}
+
+static int ili9341_set_priority(struct ili9341 *item, void __user *argp)
+{
+        struct ili9341_priority prio;
+        struct ili9341_damage_rect rect;
+        const struct ili9341_damage_rect __user *rects;
+        unsigned long *pages;
+        unsigned int i, page, last;
+
+        if (copy_from_user(&prio, argp, sizeof(prio)))
+                return -EFAULT;
+        if (prio.count > ILI9341_PRIORITY_MAX_RECTS)
+                return -EINVAL;
+
+        //Built aside and copied in a word at a time, so the flush thread
+        //never sees the regions half cleared.
+        pages = kcalloc(BITS_TO_LONGS(item->pages_count),
+                        sizeof(unsigned long), GFP_KERNEL);
+        if (!pages)
+                return -ENOMEM;
+
+        rects = (const struct ili9341_damage_rect __user *)
+                (unsigned long)prio.rects;
+        for (i = 0; i < prio.count; i++) {
+                if (copy_from_user(&rect, &rects[i], sizeof(rect))) {
+                        kfree(pages);
+                        return -EFAULT;
+                }
+                if (rect.y >= item->info->var.yres || !rect.h)
+                        continue;
+                last = item->row_last_page[min_t(unsigned int,
+                                rect.y + rect.h, item->info->var.yres) - 1];
+                for (page = item->row_first_page[rect.y]; page <= last; page++)
+                        set_bit(page, pages);
+        }
+
+        item->prio_delay = prio.delay_ms ?
+                min(msecs_to_jiffies(prio.delay_ms), item->defio.delay) : 0;
+        for (i = 0; i < BITS_TO_LONGS(item->pages_count); i++)
+                item->prio_pages[i] = pages[i];
+        kfree(pages);
+
+        return 0;
+}
+
+//Mark the rows an overlay covers, for it to be drawn or taken away.
+static void ili9341_overlay_touch(struct ili9341 *item,
+                                  const struct ili9341_overlay *o)
+{
+        if (o->visible && o->width && o->height &&
+            o->x < (int)item->info->var.xres && o->x + (int)o->width > 0)
+                ili9341_touch(item->info, o->x, o->y, o->width, o->height);
+}
+
+static int ili9341_set_sprite(struct ili9341 *item, void __user *argp)
+{
+        struct ili9341_sprite sprite;
+        struct ili9341_overlay *s, old, new;
+        unsigned int size = 0;
+        void *pixels = NULL;
+
+        if (copy_from_user(&sprite, argp, sizeof(sprite)))
+                return -EFAULT;
+        if (sprite.index >= ILI9341_SPRITES)
+                return -EINVAL;
+
+        if (sprite.flags & ILI9341_SPRITE_IMAGE) {
+                if (!sprite.width || sprite.width > ILI9341_SPRITE_MAX ||
+                    !sprite.height || sprite.height > ILI9341_SPRITE_MAX)
+                        return -EINVAL;
+                size = sprite.width * sprite.height *
+                       (item->info->var.bits_per_pixel / 8);
+                pixels = kmalloc(size, GFP_KERNEL);
+                if (!pixels)
+                        return -ENOMEM;
+                if (copy_from_user(pixels, (const void __user *)
+                                   (unsigned long)sprite.pixels, size)) {
+                        kfree(pixels);
+                        return -EFAULT;
+                }
+        }
+
+        spin_lock(&item->sprite_lock);
+        s = &item->sprites[sprite.index];
+        old = *s;
+        if (pixels) {
+                memcpy(s->pixels, pixels, size);
+                s->width = sprite.width;
+                s->height = sprite.height;
+                s->gen++;
+        }
+        s->x = sprite.x;
+        s->y = sprite.y;
+        s->key = sprite.key;
+        s->visible = !!(sprite.flags & ILI9341_SPRITE_VISIBLE);
+        new = *s;
+        spin_unlock(&item->sprite_lock);
+        kfree(pixels);
+
+        ili9341_overlay_touch(item, &old);
+        ili9341_overlay_touch(item, &new);
+
+        return 0;
+}
+
+//Whether the flush numbered seq has finished.
+static inline int ili9341_flushed(struct ili9341 *item, u32 seq)
+{
+        return (s32)(item->flush_seq - seq) >= 0;
+}
+
+static int ili9341_flush_wait(struct ili9341 *item, void __user *argp)
+{
+        struct ili9341_flush_wait req;
+        u32 target;
+        long ret;
+
+        if (copy_from_user(&req, argp, sizeof(req)))
+                return -EFAULT;
+
+        //Hand over what deferred io is still sitting on and run the flush
+        //now instead of after the delay.
+        if (item->info->fbdefio)
+                flush_delayed_work(&item->info->deferred_work);
+        del_timer(&item->flush_timer);
+        //Pairs with the swap in ili9341_flush(): the first flush to start
+        //from here on sees all damage marked so far.
+        smp_mb();
+        target = item->flush_started + 1;
+        queue_kthread_work(&item->flush_worker, &item->flush_work);
+
+        if (req.timeout_ms) {
+                ret = wait_event_interruptible_timeout(item->flush_wq,
+                                ili9341_flushed(item, target),
+                                msecs_to_jiffies(req.timeout_ms));
+                if (!ret)
+                        return -ETIMEDOUT;
+        } else {
+                ret = wait_event_interruptible(item->flush_wq,
+                                ili9341_flushed(item, target));
+        }
+        if (ret < 0)
+                return ret;
+
+        spin_lock(&item->flush_lock);
+        req.seq = item->flush_seq;
+        req.done_ns = item->flush_done_ns;
+        spin_unlock(&item->flush_lock);
+
+        return copy_to_user(argp, &req, sizeof(req)) ? -EFAULT : 0;
+}
+
+static int ili9341_ioctl(struct fb_info *info, unsigned int cmd,
+                         unsigned long arg)
+{
+        struct ili9341 *item = (struct ili9341 *)info->par;
+        u32 tracking;
+
+        switch (cmd) {
+        case ILI9341IO_DAMAGE:
+                return ili9341_damage(item, (void __user *)arg);
+        case ILI9341IO_SET_TRACKING:
+                if (get_user(tracking, (u32 __user *)arg))
+                        return -EFAULT;
+                item->untracked = !tracking;
+                return 0;
+        case ILI9341IO_FLUSH_WAIT:
+                return ili9341_flush_wait(item, (void __user *)arg);
+        case ILI9341IO_SET_PRIORITY:
+                return ili9341_set_priority(item, (void __user *)arg);
+        case ILI9341IO_SET_SPRITE:
+                return ili9341_set_sprite(item, (void __user *)arg);
+        }
+
+        return -ENOTTY;
+}
+
+//Mappings made while tracking is off see the framebuffer directly, without
+//the write faults deferred io needs to find dirty pages.
+static int ili9341_mmap(struct fb_info *info, struct vm_area_struct *vma)
+{
+        struct ili9341 *item = (struct ili9341 *)info->par;
+        unsigned long size = vma->vm_end - vma->vm_start;
+
+        if (!item->untracked)
+                return item->defio_mmap(info, vma);
+
+        if (!item->fb_dma)
+                return remap_vmalloc_range(vma,
+                                           (void __force *)info->screen_base,
+                                           vma->vm_pgoff);
+
+        if (vma->vm_pgoff > info->fix.smem_len >> PAGE_SHIFT ||
+            size > info->fix.smem_len - (vma->vm_pgoff << PAGE_SHIFT))
+                return -EINVAL;
+        return remap_pfn_range(vma, vma->vm_start,
+                               (info->fix.smem_start >> PAGE_SHIFT) +
+                               vma->vm_pgoff, size, vma->vm_page_prot);
+}
+
+static const struct fb_ops ili9341_fbops = {
         .owner        = THIS_MODULE,
         .fb_read      = fb_sys_read,
         .fb_write     = ili9341_write,
@@ -626,23 +2457,24 @@ static struct fb_ops ili9341_fbops = {
         .fb_imageblit = ili9341_imageblit,
         .fb_setcolreg   = ili9341_setcolreg,
         .fb_blank       = ili9341_blank,
+        .fb_ioctl       = ili9341_ioctl,
 };
 
-static struct fb_fix_screeninfo ili9341_fix __initdata = {
+static const struct fb_fix_screeninfo ili9341_fix = {
         .id          = "ILI9341",
         .type        = FB_TYPE_PACKED_PIXELS,
         .visual      = FB_VISUAL_TRUECOLOR,
         .accel       = FB_ACCEL_NONE,
-        .line_length = 320 * 2,
+        .line_length = 240 * 2,
 };
 
-static struct fb_var_screeninfo ili9341_var __initdata = {
-        .xres           = 320,
-        .yres           = 240,
-        .xres_virtual   = 320,
-        .yres_virtual   = 240,
-        .width          = 320,
-        .height         = 240,
+static const struct fb_var_screeninfo ili9341_var = {
+        .xres           = 240,
+        .yres           = 320,
+        .xres_virtual   = 240,
+        .yres_virtual   = 320,
+        .width          = ILI9341_WIDTH_MM,
+        .height         = ILI9341_HEIGHT_MM,
         .bits_per_pixel = 16,
     	.red   			= {11, 5, 0},
     	.green 			= {5, 6, 0},
@@ -651,126 +2483,494 @@ static struct fb_var_screeninfo ili9341_var __initdata = {
         .vmode          = FB_VMODE_NONINTERLACED,
 };
 
-static struct fb_deferred_io ili9341_defio = {
-        .delay          = HZ / 35,
-        .deferred_io    = &ili9341_update,
+//Default deferred io delay; each panel gets its own fb_deferred_io copy.
+#define ILI9341_DEFIO_DELAY		(HZ / 35)
+
+//Per-panel configuration comes from platform data, then devicetree, and
+//falls back to the module parameters for anything not described there.
+static int ili9341_get_config(struct ili9341 *item)
+{
+        struct ili9341_platform_data *pdata = item->dev->platform_data;
+        struct device_node *np = item->dev->of_node;
+        u32 val;
+
+        item->dc_gpio = ILI_GPIO_DC;
+        item->rotate = rotate;
+        item->bgr = mode_BGR;
+
+        if (pdata) {
+                item->dc_gpio = pdata->dc_gpio;
+                item->rotate = pdata->rotate;
+                item->bgr = pdata->bgr;
+        } else if (np) {
+                item->dc_gpio = of_get_named_gpio(np, "dc-gpios", 0);
+                if (item->dc_gpio < 0)
+                        return item->dc_gpio;
+                if (!of_property_read_u32(np, "rotation", &val))
+                        item->rotate = val;
+                if (of_property_read_bool(np, "bgr"))
+                        item->bgr = 1;
+        }
+
+        switch (item->rotate) {
+        case 0:
+        case 90:
+        case 180:
+        case 270:
+                return 0;
+        default:
+                dev_err(item->dev, "%s: unsupported rotation %d\n",
+                        __func__, item->rotate);
+                return -EINVAL;
+        }
+}
+
+#define ILI9341_RAMP_REF_HZ		1000000
+#define ILI9341_RAMP_STEP_HZ		4000000
+#define ILI9341_RAMP_READS		4
+
+static int ili9341_ramp_check(struct ili9341 *item, u32 speed_hz,
+                              const u8 *id, const u8 *status)
+{
+        u8 buf[4];
+        int i;
+
+        for (i = 0; i < ILI9341_RAMP_READS; i++) {
+                if (ili9341_read_reg(item, 0xd3, buf, 3, 8, speed_hz) ||
+                    memcmp(buf, id, 3))
+                        return -EIO;
+                if (ili9341_read_reg(item, 0x04, buf, 3, 1, speed_hz) ||
+                    memcmp(buf, status, 3))
+                        return -EIO;
+        }
+
+        return 0;
+}
+
+//Find the fastest clock at which the ID registers (0xd3 and 0x04) still read
+//back what they do at ILI9341_RAMP_REF_HZ. Reads are specified slower than
+//writes, so a clock that reads reliably writes reliably too.
+static void ili9341_ramp_speed(struct ili9341 *item)
+{
+        struct spi_device *spi = item->spi;
+        u32 speed, best = spi->max_speed_hz;
+        u32 limit = spi->max_speed_hz;
+        u8 id[3], status[3];
+
+        if (ili9341_read_reg(item, 0xd3, id, 3, 8, ILI9341_RAMP_REF_HZ) ||
+            ili9341_read_reg(item, 0x04, status, 3, 1, ILI9341_RAMP_REF_HZ) ||
+            id[1] != 0x93 || id[2] != 0x41) {
+                dev_info(item->dev, "%s: can't read the ID back, "
+                         "keeping %u Hz\n", __func__, best);
+                return;
+        }
+
+        //The SPI core clamps every transfer to max_speed_hz, so it has
+        //to be raised for the duration of the ramp.
+        spi->max_speed_hz = speed_ramp_max;
+        for (speed = best + ILI9341_RAMP_STEP_HZ; speed <= speed_ramp_max;
+             speed += ILI9341_RAMP_STEP_HZ) {
+                if (ili9341_ramp_check(item, speed, id, status))
+                        break;
+                best = speed;
+        }
+        spi->max_speed_hz = max(best, limit);
+        spi_setup(spi);
+
+        dev_info(item->dev, "%s: using %u Hz\n", __func__, best);
+        item->speed_hz = best;
+}
+
+#ifdef ILI9341_DRM
+struct ili9341_drm {
+        struct drm_device drm;
+        struct drm_simple_display_pipe pipe;
+        struct drm_connector connector;
+        struct drm_display_mode mode;
+        struct ili9341 *item;
+};
+
+static int ili9341_drm_get_modes(struct drm_connector *connector)
+{
+        struct ili9341_drm *idrm = container_of(connector, struct ili9341_drm,
+                                                connector);
+        struct drm_display_mode *mode;
+
+        mode = drm_mode_duplicate(connector->dev, &idrm->mode);
+        if (!mode)
+                return 0;
+        drm_mode_set_name(mode);
+        mode->type |= DRM_MODE_TYPE_PREFERRED;
+        drm_mode_probed_add(connector, mode);
+
+        return 1;
+}
+
+static const struct drm_connector_helper_funcs ili9341_drm_connector_hfuncs = {
+        .get_modes = ili9341_drm_get_modes,
+};
+
+static const struct drm_connector_funcs ili9341_drm_connector_funcs = {
+        .reset = drm_atomic_helper_connector_reset,
+        .fill_modes = drm_helper_probe_single_connector_modes,
+        .destroy = drm_connector_cleanup,
+        .atomic_duplicate_state = drm_atomic_helper_connector_duplicate_state,
+        .atomic_destroy_state = drm_atomic_helper_connector_destroy_state,
+};
+
+//Copy a damage clip out of the DRM framebuffer into the driver's own one,
+//in whatever red/blue order that has been set up with. The flush thread
+//diffs and sends it from there like any fbdev update.
+static void ili9341_drm_blit(struct ili9341 *item,
+                             struct drm_plane_state *state,
+                             const struct drm_rect *clip)
+{
+        struct drm_framebuffer *fb = state->fb;
+        struct drm_gem_cma_object *cma = drm_fb_cma_get_gem_obj(fb, 0);
+        struct fb_var_screeninfo *var = &item->info->var;
+        unsigned int cpp = fb->format->cpp[0];
+        unsigned int width = drm_rect_width(clip);
+        int dx = clip->x1 - (state->src.x1 >> 16);
+        int dy = clip->y1 - (state->src.y1 >> 16);
+        unsigned int x, y, r, g, b;
+        const void *src;
+        u16 *dst;
+        u32 p;
+
+        for (y = 0; y < drm_rect_height(clip); y++) {
+                src = cma->vaddr + fb->offsets[0] +
+                      (clip->y1 + y) * fb->pitches[0] + clip->x1 * cpp;
+                dst = (u16 *)(item->info->screen_base +
+                              (dy + y) * item->info->fix.line_length) + dx;
+
+                if (fb->format->format == DRM_FORMAT_RGB565 &&
+                    var->red.offset == 11) {
+                        memcpy(dst, src, width * 2);
+                        continue;
+                }
+                for (x = 0; x < width; x++) {
+                        if (fb->format->format == DRM_FORMAT_RGB565) {
+                                p = ((const u16 *)src)[x];
+                                r = (p >> 8) & 0xf8;
+                                g = (p >> 3) & 0xfc;
+                                b = (p << 3) & 0xf8;
+                        } else {
+                                p = ((const u32 *)src)[x];
+                                r = (p >> 16) & 0xff;
+                                g = (p >> 8) & 0xff;
+                                b = p & 0xff;
+                        }
+                        dst[x] = (r >> 3) << var->red.offset |
+                                 (g >> 2) << var->green.offset |
+                                 (b >> 3) << var->blue.offset;
+                }
+        }
+}
+
+static void ili9341_drm_update(struct drm_simple_display_pipe *pipe,
+                               struct drm_plane_state *old_state)
+{
+        struct ili9341_drm *idrm = container_of(pipe, struct ili9341_drm, pipe);
+        struct ili9341 *item = idrm->item;
+        struct drm_plane_state *state = pipe->plane.state;
+        struct drm_atomic_helper_damage_iter iter;
+        struct drm_rect clip;
+        int idx, superseded = 0;
+
+        if (!pipe->crtc.state->active || !state->fb)
+                return;
+        if (!drm_dev_enter(&idrm->drm, &idx))
+                return;
+
+        drm_atomic_helper_damage_iter_init(&iter, old_state, state);
+        drm_atomic_for_each_plane_damage(&iter, &clip) {
+                ili9341_drm_blit(item, state, &clip);
+                superseded |= ili9341_mark_rows(item,
+                                clip.y1 - (state->src.y1 >> 16),
+                                drm_rect_height(&clip));
+        }
+        ili9341_count_frame(item, superseded);
+        //The commit already batches the damage, no point in waiting.
+        queue_kthread_work(&item->flush_worker, &item->flush_work);
+
+        drm_dev_exit(idx);
+}
+
+static const struct drm_simple_display_pipe_funcs ili9341_drm_pipe_funcs = {
+        .update = ili9341_drm_update,
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 13, 0)
+        .prepare_fb = drm_gem_fb_simple_display_pipe_prepare_fb,
+#endif
+};
+
+static const struct drm_mode_config_funcs ili9341_drm_mode_config_funcs = {
+        .fb_create = drm_gem_fb_create_with_dirty,
+        .atomic_check = drm_atomic_helper_check,
+        .atomic_commit = drm_atomic_helper_commit,
+};
+
+static const u32 ili9341_drm_formats[] = {
+        DRM_FORMAT_RGB565,
+        DRM_FORMAT_XRGB8888,
+};
+
+DEFINE_DRM_GEM_CMA_FOPS(ili9341_drm_fops);
+
+static const struct drm_driver ili9341_drm_driver = {
+        .driver_features = DRIVER_GEM | DRIVER_MODESET | DRIVER_ATOMIC,
+        .fops = &ili9341_drm_fops,
+        DRM_GEM_CMA_DRIVER_OPS_VMAP,
+        .name = "ili9341",
+        .desc = "ILI9341 SPI panel",
+        .date = "20261018",
+        .major = 1,
+        .minor = 0,
 };
 
-static int __init ili9341_probe(struct platform_device *dev)
+//The panel, bus and flush thread are already up by the time this runs; all
+//the DRM side adds is a different way of finding out what changed.
+static int ili9341_drm_init(struct ili9341 *item)
+{
+        unsigned int xres = item->info->var.xres;
+        unsigned int yres = item->info->var.yres;
+        struct ili9341_drm *idrm;
+        struct drm_device *drm;
+        int ret;
+
+        idrm = devm_drm_dev_alloc(item->dev, &ili9341_drm_driver,
+                                  struct ili9341_drm, drm);
+        if (IS_ERR(idrm))
+                return PTR_ERR(idrm);
+        idrm->item = item;
+        drm = &idrm->drm;
+
+        ret = drmm_mode_config_init(drm);
+        if (ret)
+                return ret;
+        drm->mode_config.min_width = xres;
+        drm->mode_config.max_width = xres;
+        drm->mode_config.min_height = yres;
+        drm->mode_config.max_height = yres;
+        drm->mode_config.preferred_depth = 16;
+        drm->mode_config.funcs = &ili9341_drm_mode_config_funcs;
+
+        idrm->mode = (struct drm_display_mode){ DRM_SIMPLE_MODE(xres, yres, 0, 0) };
+
+        drm_connector_helper_add(&idrm->connector,
+                                 &ili9341_drm_connector_hfuncs);
+        ret = drm_connector_init(drm, &idrm->connector,
+                                 &ili9341_drm_connector_funcs,
+                                 DRM_MODE_CONNECTOR_SPI);
+        if (ret)
+                return ret;
+
+        ret = drm_simple_display_pipe_init(drm, &idrm->pipe,
+                                           &ili9341_drm_pipe_funcs,
+                                           ili9341_drm_formats,
+                                           ARRAY_SIZE(ili9341_drm_formats),
+                                           NULL, &idrm->connector);
+        if (ret)
+                return ret;
+        drm_plane_enable_fb_damage_clips(&idrm->pipe.plane);
+        drm_mode_config_reset(drm);
+
+        ret = drm_dev_register(drm, 0);
+        if (ret)
+                return ret;
+        item->drm = idrm;
+
+        drm_fbdev_generic_setup(drm, 16);
+
+        return 0;
+}
+
+static void ili9341_drm_fini(struct ili9341 *item)
+{
+        drm_dev_unplug(&item->drm->drm);
+        drm_atomic_helper_shutdown(&item->drm->drm);
+}
+#else
+static int ili9341_drm_init(struct ili9341 *item)
+{
+        dev_err(item->dev, "%s: built without DRM support\n", __func__);
+        return -ENODEV;
+}
+
+static void ili9341_drm_fini(struct ili9341 *item)
+{
+}
+#endif
+
+//Sending straight from the framebuffer needs the controller to do DMA and
+//shift out 16-bit words.
+static int ili9341_check_fb_dma(struct ili9341 *item)
+{
+        struct spi_device *spi = item->spi;
+        u8 bits = spi->bits_per_word;
+        int ret;
+
+        if (!item->dma_dev)
+                return -ENODEV;
+
+        spi->bits_per_word = 16;
+        ret = spi_setup(spi);
+        spi->bits_per_word = bits;
+        spi_setup(spi);
+
+        return ret;
+}
+
+static int ili9341_probe(struct spi_device *spi)
 {
         int ret = 0;
         struct ili9341 *item;
         struct fb_info *info;
 
-        dev_dbg(&dev->dev, "%s\n", __func__);
+        dev_dbg(&spi->dev, "%s\n", __func__);
 
         item = kzalloc(sizeof(struct ili9341), GFP_KERNEL);
         if (!item) {
-                dev_err(&dev->dev,
+                dev_err(&spi->dev,
                         "%s: unable to kzalloc for ili9341\n", __func__);
                 ret = -ENOMEM;
                 goto out;
         }
-        item->dev = &dev->dev;
-        dev_set_drvdata(&dev->dev, item);
-        dev_dbg(&dev->dev, "Before registering SPI\n");
+        item->dev = &spi->dev;
+        item->spi = spi;
+        item->window_cost = ILI9341_WINDOW_COST;
+        item->max_fps = min_t(unsigned int, max_fps, HZ);
+        item->fb_dma = fb_dma;
+        item->use_drm = use_drm;
+        item->dma_dev = spi->master->dev.parent;
+        mutex_init(&item->selftest_lock);
+        spin_lock_init(&item->flush_lock);
+        spin_lock_init(&item->sprite_lock);
+        init_waitqueue_head(&item->flush_wq);
+        init_kthread_work(&item->verify_work, ili9341_verify);
+        init_kthread_work(&item->calibrate_work, ili9341_calibrate_work);
+        spi_set_drvdata(spi, item);
+
+        ret = ili9341_get_config(item);
+        if (ret)
+                goto out_item;
 
-        info = framebuffer_alloc(sizeof(struct ili9341), &dev->dev);
+        info = framebuffer_alloc(sizeof(struct ili9341), &spi->dev);
         if (!info) {
                 ret = -ENOMEM;
-                dev_err(&dev->dev,
+                dev_err(&spi->dev,
                         "%s: unable to framebuffer_alloc\n", __func__);
                 goto out_item;
         }
         info->pseudo_palette = &item->pseudo_palette;
         item->info = info;
         info->par = item;
-        info->dev = &dev->dev;
-        info->fbops = &ili9341_fbops;
+        info->dev = &spi->dev;
+        item->fbops = ili9341_fbops;
+        info->fbops = &item->fbops;
         info->flags = FBINFO_FLAG_DEFAULT;
         info->fix = ili9341_fix;
-        if (mode_BGR)	{
-        	ili9341_var.red.offset  = 0;
-        	ili9341_var.red.length  = 5;
-        	ili9341_var.red.msb_right  = 0;
-        	ili9341_var.green.offset = 5;
-        	ili9341_var.green.length  = 6;
-        	ili9341_var.green.msb_right  = 0;
-        	ili9341_var.blue.offset  = 11;
-        	ili9341_var.blue.length  = 5;
-        	ili9341_var.blue.msb_right  = 0;
-        } else	{
-        	ili9341_var.red.offset  = 11;
-        	ili9341_var.red.length  = 5;
-        	ili9341_var.red.msb_right  = 0;
-        	ili9341_var.green.offset = 5;
-        	ili9341_var.green.length  = 6;
-        	ili9341_var.green.msb_right  = 0;
-        	ili9341_var.blue.offset  = 0;
-        	ili9341_var.blue.length  = 5;
-        	ili9341_var.blue.msb_right  = 0;
-        }
         info->var = ili9341_var;
+        ili9341_set_geometry(item);
 
-        item->tmpbuf = kmalloc(PAGE_SIZE, GFP_KERNEL);
-        if (!item->tmpbuf) {
-        	ret = -ENOMEM;
-        	dev_err(&dev->dev, "%s: unable to allocate memory for tmpbuf\n", __func__);
-        	goto out_tmpbuf;
-        }
+        ret = ili9341_select_convert(item);
+        if (ret)
+                goto out_tmpbuf;
 
-        item->tmpbuf_be = kmalloc(PAGE_SIZE, GFP_DMA);
-        if (!item->tmpbuf_be) {
-        	ret = -ENOMEM;
-        	dev_err(&dev->dev, "%s: unable to allocate memory for tmpbuf_be\n", __func__);
-        	goto out_tmpbuf_be;
-        }
+        ret = ili9341_tx_alloc(item);
+        if (ret)
+                goto out_tmpbuf;
 
-     	struct device* spidevice = bus_find_device_by_name(&spi_bus_type, NULL, "spi1.0");
-     	if (!spidevice) {
-     		dev_err(&dev->dev, "%s: Couldn't find SPI device\n", __func__);
-     		ret = -ENODEV;
-     		goto out_tmpbuf_be;
-     	}
-     	item->spi = to_spi_device(spidevice);
+        if (item->fb_dma && ili9341_check_fb_dma(item)) {
+                dev_warn(&spi->dev, "%s: controller can't send 16-bit words, "
+                         "not using fb_dma\n", __func__);
+                item->fb_dma = 0;
+        }
 
-    	ili9341_init_gpio(item);
+        ret = ili9341_init_gpio(item);
+        if (ret) {
+                dev_err(&spi->dev, "%s: unable to request DC gpio %d\n",
+                        __func__, item->dc_gpio);
+                goto out_info;
+        }
      	ili9341_init_display(item);
+        if (speed_ramp_max)
+                ili9341_ramp_speed(item);
 
         ret = ili9341_video_alloc(item);
         if (ret) {
-                dev_err(&dev->dev,
+                dev_err(&spi->dev,
                         "%s: unable to ili9341_video_alloc\n", __func__);
-                goto out_info;
+                goto out_gpio;
         }
-        info->screen_base = (char __iomem *)item->info->fix.smem_start;
         ret = ili9341_pages_alloc(item);
         if (ret < 0) {
-                dev_err(&dev->dev,
+                dev_err(&spi->dev,
                         "%s: unable to ili9341_pages_init\n", __func__);
                 goto out_video;
         }
+        ili9341_calibrate(item);
 
-        info->fbdefio = &ili9341_defio;
-        fb_deferred_io_init(info);
-
-        ret = register_framebuffer(info);
-        if (ret < 0) {
-                dev_err(&dev->dev,
-                        "%s: unable to register_frambuffer\n", __func__);
+        ret = ili9341_flush_start(item);
+        if (ret)
                 goto out_pages;
+
+        if (item->use_drm) {
+                ret = ili9341_drm_init(item);
+                if (ret) {
+                        dev_err(&spi->dev, "%s: unable to set up DRM: %d\n",
+                                __func__, ret);
+                        goto out_thread;
+                }
+        } else {
+                item->defio.delay = ILI9341_DEFIO_DELAY;
+                item->defio.deferred_io = &ili9341_update;
+                info->fbdefio = &item->defio;
+                fb_deferred_io_init(info);
+                //Deferred io installs its own mmap; keep it for tracked
+                //mappings.
+                item->defio_mmap = info->fbops->fb_mmap;
+                info->fbops->fb_mmap = ili9341_mmap;
+
+                ret = register_framebuffer(info);
+                if (ret < 0) {
+                        dev_err(&spi->dev,
+                                "%s: unable to register_frambuffer\n",
+                                __func__);
+                        goto out_flush;
+                }
         }
 
+        if (device_create_file(&spi->dev, &dev_attr_flush_prio))
+                dev_warn(&spi->dev, "%s: unable to create flush_prio\n",
+                         __func__);
+        if (device_create_file(&spi->dev, &dev_attr_spi_speed_hz))
+                dev_warn(&spi->dev, "%s: unable to create spi_speed_hz\n",
+                         __func__);
+        if (device_create_file(&spi->dev, &dev_attr_chunk_size))
+                dev_warn(&spi->dev, "%s: unable to create chunk_size\n",
+                         __func__);
+        if (device_create_file(&spi->dev, &dev_attr_max_fps))
+                dev_warn(&spi->dev, "%s: unable to create max_fps\n",
+                         __func__);
+        if (device_create_file(&spi->dev, &dev_attr_flush_stats))
+                dev_warn(&spi->dev, "%s: unable to create flush_stats\n",
+                         __func__);
+        ili9341_debugfs_init(item);
+
         return ret;
 
+out_flush:
+		fb_deferred_io_cleanup(info);
+out_thread:
+		ili9341_flush_stop(item);
 out_pages:
 		ili9341_pages_free(item);
 out_video:
 		ili9341_video_free(item);
+out_gpio:
+		ili9341_free_gpio(item);
 out_info:
-		kfree(item->tmpbuf_be);
-out_tmpbuf_be:
-		kfree(item->tmpbuf);
+		ili9341_tx_free(item);
 out_tmpbuf:
         framebuffer_release(info);
 out_item:
@@ -779,26 +2979,56 @@ out:
         return ret;
 }
 
-static int ili9341_remove(struct platform_device *device)
+static int ili9341_remove(struct spi_device *spi)
 {
-        struct fb_info *info = platform_get_drvdata(device);
-        struct ili9341 *item = (struct ili9341 *)info->par;
-        if (info) {
-                unregister_framebuffer(info);
+        struct ili9341 *item = spi_get_drvdata(spi);
+        struct fb_info *info;
+
+        if (item) {
+                info = item->info;
+                debugfs_remove_recursive(item->debugfs);
+                device_remove_file(&spi->dev, &dev_attr_flush_stats);
+                device_remove_file(&spi->dev, &dev_attr_max_fps);
+                device_remove_file(&spi->dev, &dev_attr_chunk_size);
+                device_remove_file(&spi->dev, &dev_attr_spi_speed_hz);
+                device_remove_file(&spi->dev, &dev_attr_flush_prio);
+                if (item->use_drm) {
+                        ili9341_drm_fini(item);
+                } else {
+                        unregister_framebuffer(info);
+                        fb_deferred_io_cleanup(info);
+                }
+                ili9341_flush_stop(item);
                 ili9341_pages_free(item);
                 ili9341_video_free(item);
+                ili9341_free_gpio(item);
+                ili9341_tx_free(item);
                 framebuffer_release(info);
                 kfree(item);
         }
-        ili9341_free_gpio();
         return 0;
 }
 
-static struct platform_driver ili9341_driver = {
+static const struct spi_device_id ili9341_ids[] = {
+        { "ili9341", 0 },
+        { },
+};
+MODULE_DEVICE_TABLE(spi, ili9341_ids);
+
+static const struct of_device_id ili9341_of_match[] = {
+        { .compatible = "ilitek,ili9341" },
+        { },
+};
+MODULE_DEVICE_TABLE(of, ili9341_of_match);
+
+static struct spi_driver ili9341_driver = {
         .probe = ili9341_probe,
         .remove = ili9341_remove,
+        .id_table = ili9341_ids,
         .driver = {
                    .name = "ili9341",
+                   .owner = THIS_MODULE,
+                   .of_match_table = of_match_ptr(ili9341_of_match),
                    },
 };
 
@@ -808,22 +3038,22 @@ static int __init ili9341_init(void)
 
         pr_debug("%s\n", __func__);
 
-        ret = platform_driver_register(&ili9341_driver);
+        ret = spi_register_driver(&ili9341_driver);
 
         if (ret) {
-                pr_err("%s: unable to platform_driver_register\n", __func__);
-        }
-
-        ret = platform_device_register(&ili9341_device);
-
-        if (ret) {
-                pr_err("%s: unable to platform_device_register\n", __func__);
+                pr_err("%s: unable to spi_register_driver\n", __func__);
         }
 
         return ret;
 }
 
+static void __exit ili9341_exit(void)
+{
+        spi_unregister_driver(&ili9341_driver);
+}
+
 module_init(ili9341_init);
+module_exit(ili9341_exit);
 
 MODULE_LICENSE("GPL v2");
 MODULE_AUTHOR("Alex Nikitenko, alex.nikitenko@sirinsoftware.com");
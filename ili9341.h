@@ -0,0 +1,120 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+
+/*
+ * Framebuffer support for ILI9341 series - board configuration
+ *
+ * Copyright (C) Sirin Software LLC
+ * Author: Alex Nikitenko <alex.nikitenko@sirinsoftware.com>
+ */
+
+#ifndef __ILI9341_H
+#define __ILI9341_H
+
+#include <linux/ioctl.h>
+#include <linux/types.h>
+
+/*
+ * Explicit damage reporting for renderers that know what they drew. The
+ * rectangles are in pixels; they are marked dirty as if they had been written
+ * through mmap, and only the pixels that actually changed go to the panel.
+ */
+struct ili9341_damage_rect {
+	__u16 x;
+	__u16 y;
+	__u16 w;
+	__u16 h;
+};
+
+struct ili9341_damage {
+	__u64 rects;	/* user pointer to count struct ili9341_damage_rect */
+	__u32 count;
+	__u32 flags;	/* ILI9341_DAMAGE_* */
+};
+
+/* Flush right away instead of after the deferred io delay. */
+#define ILI9341_DAMAGE_FLUSH		(1 << 0)
+
+#define ILI9341_DAMAGE_MAX_RECTS	256
+
+#define ILI9341IO_DAMAGE		_IOW('F', 0xa0, struct ili9341_damage)
+/*
+ * Takes a __u32: 0 maps the framebuffer without write fault tracking for
+ * every mmap() from then on, leaving damage to ILI9341IO_DAMAGE; 1 goes back
+ * to tracking. Mappings that already exist keep the mode they were made in.
+ */
+#define ILI9341IO_SET_TRACKING		_IOW('F', 0xa1, __u32)
+
+/*
+ * Flush pending damage right away and wait until it has reached the panel.
+ * done_ns is the CLOCK_MONOTONIC time the last pixel of that flush was sent.
+ */
+struct ili9341_flush_wait {
+	__u32 timeout_ms;	/* in: 0 waits as long as it takes */
+	__u32 seq;		/* out: number of the flush that covered it */
+	__u64 done_ns;		/* out: when that flush finished */
+};
+
+#define ILI9341IO_FLUSH_WAIT		_IOWR('F', 0xa2, struct ili9341_flush_wait)
+
+/*
+ * Regions flushed ahead of the rest of the screen, such as a cursor or touch
+ * feedback. Every flush sends the damage inside them first. With delay_ms
+ * set, damage reported inside them through ILI9341IO_DAMAGE or fbdev drawing
+ * is flushed after that long instead of the deferred io delay. Each call
+ * replaces the previous regions; count 0 clears them.
+ */
+struct ili9341_priority {
+	__u64 rects;	/* user pointer to count struct ili9341_damage_rect */
+	__u32 count;
+	__u32 delay_ms;	/* 0 keeps the deferred io delay */
+};
+
+#define ILI9341_PRIORITY_MAX_RECTS	16
+
+#define ILI9341IO_SET_PRIORITY		_IOW('F', 0xa3, struct ili9341_priority)
+
+/*
+ * Software overlays drawn over the framebuffer on the way to the panel, such
+ * as a mouse or touch cursor. They never touch the framebuffer itself: moving
+ * one only resends what changed where it was and where it is now. Sprite 0
+ * is drawn on top of the others and is meant for the cursor. x and y may be
+ * off screen. With ILI9341_SPRITE_IMAGE the call also replaces the image,
+ * width x height pixels in framebuffer format; otherwise those fields and
+ * pixels are ignored. Pixels equal to key are transparent.
+ */
+struct ili9341_sprite {
+	__u32 index;	/* 0 .. ILI9341_SPRITES - 1 */
+	__u32 flags;	/* ILI9341_SPRITE_* */
+	__s32 x;
+	__s32 y;
+	__u32 width;
+	__u32 height;
+	__u32 key;
+	__u32 reserved;
+	__u64 pixels;	/* user pointer, rows of width pixels */
+};
+
+#define ILI9341_SPRITE_VISIBLE		(1 << 0)
+#define ILI9341_SPRITE_IMAGE		(1 << 1)
+
+#define ILI9341_SPRITES			4
+#define ILI9341_SPRITE_MAX		64
+
+#define ILI9341IO_SET_SPRITE		_IOW('F', 0xa4, struct ili9341_sprite)
+
+#ifdef __KERNEL__
+
+/*
+ * Per-panel configuration, passed as platform_data of an spi_board_info with
+ * modalias "ili9341"; one SPI device per panel. Devicetree users describe the
+ * same through "dc-gpios", "rotation" and "bgr" on an "ilitek,ili9341" node.
+ */
+struct ili9341_platform_data {
+	int dc_gpio;	/* D/C line: high - data, low - command */
+	int rotate;	/* 0, 90, 180 or 270 */
+	int bgr;	/* panel is wired BGR */
+};
+
+#endif /* __KERNEL__ */
+
+#endif /* __ILI9341_H */
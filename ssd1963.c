@@ -3,7 +3,8 @@
 /*
  * SSD1963 LCD framebuffer driver
  *
- * Panel:    Newhaven NHD-5.7-320240WFB-CTXI-T1 (320x240)
+ * Panel:    Newhaven NHD-5.7-320240WFB-CTXI-T1 (320x240) by default, any
+ *           TFT panel up to 864x480 through struct ssd1963_panel
  * Bus:      8-bit parallel (8080) via GPIO
  * Platform: CoreWind AT91SAM9G45 (IPC-SAM9G45), 2.6.3x kernels
  *
@@ -16,28 +17,161 @@
 #include <linux/module.h>
 #include <linux/platform_device.h>
 #include <linux/mm.h>
+#include <linux/slab.h>
 #include <linux/vmalloc.h>
 #include <linux/fb.h>
 #include <asm/io.h>
 #include <asm/gpio.h>
 #include <linux/delay.h>
+#include <linux/kthread.h>
+#include <linux/sched.h>
+#include <linux/timer.h>
+#include <linux/uaccess.h>
+#include <linux/wait.h>
+#include <linux/ktime.h>
+#include <linux/hash.h>
+
+#include "ssd1963.h"
+
+//The BSP kernels this runs on predate READ_ONCE()/WRITE_ONCE().
+#ifndef READ_ONCE
+#define READ_ONCE(x)			ACCESS_ONCE(x)
+#define WRITE_ONCE(x, val)		(ACCESS_ONCE(x) = (val))
+#endif
+
+//Flushes run on a dedicated thread per panel instead of the shared system
+//workqueue. 0 keeps the thread SCHED_NORMAL, 1..99 makes it SCHED_FIFO with
+//that priority; the value can be changed per panel through sysfs later on.
+static int flush_prio;
+module_param(flush_prio, int, 0644);
+MODULE_PARM_DESC(flush_prio, "SCHED_FIFO priority of the flush thread (0 = SCHED_NORMAL)");
+
+//CPU the flush threads are bound to, -1 leaves them free to migrate.
+static int flush_cpu = -1;
+module_param(flush_cpu, int, 0444);
+MODULE_PARM_DESC(flush_cpu, "CPU to bind the flush threads to (-1 = any)");
+
+//Upper bound on flushes per second, 0 for none. Drawing faster than that
+//only ever sends the latest contents; changeable per panel through sysfs.
+static unsigned int max_fps;
+module_param(max_fps, uint, 0644);
+MODULE_PARM_DESC(max_fps, "Most flushes per second (0 = no limit)");
+
+//Order rows go out in. A long flush sent top to bottom shows as a wipe;
+//interleaved stripes spread it over the screen, and following the scan
+//starts right behind the row the panel is refreshing, so the refresh has
+//a whole frame before it catches up with fresh rows.
+enum {
+	SSD1963_ORDER_LINEAR,
+	SSD1963_ORDER_INTERLEAVE,
+	SSD1963_ORDER_SCAN,
+	SSD1963_ORDERS
+};
+
+static unsigned int flush_order;
+module_param(flush_order, uint, 0444);
+MODULE_PARM_DESC(flush_order, "Flush row order: 0 = top to bottom, 1 = interleaved stripes, 2 = behind the scanline");
+
+//Mounting of panels without platform_data, in degrees clockwise.
+static int rotate;
+module_param(rotate, int, 0444);
+MODULE_PARM_DESC(rotate, "Panel rotation in degrees: 0, 90, 180 or 270");
+
+//180 degrees normally just flips the panel's scan direction; some wirings
+//get that wrong, so it can be done in software like 90 and 270.
+static bool soft_rotate;
+module_param(soft_rotate, bool, 0444);
+MODULE_PARM_DESC(soft_rotate, "Rotate 180 degrees in software instead of in the controller");
+
+//fbcon text normally lands in the framebuffer and reaches the panel with
+//the pages around it. With the cache, every 8 pixel wide cell goes out as
+//it is instead, and the flush thread keeps the cells it has sent before in
+//panel format.
+static bool glyph_cache = true;
+module_param(glyph_cache, bool, 0444);
+MODULE_PARM_DESC(glyph_cache, "Send console text straight from a glyph cache");
+
+//Framebuffer depth. 8 is paletted: the palette lives in the driver, starts
+//out as RGB332 and is expanded at flush time, so mostly static screens
+//need a quarter of the memory and page tracking of 32.
+static unsigned int bpp;
+module_param(bpp, uint, 0444);
+MODULE_PARM_DESC(bpp, "Framebuffer bits per pixel: 8 (paletted), 16 or 32 (0 = build default)");
 
 #define NHD_COMMAND			1
 #define NHD_DATA			0
 
-static unsigned int nhd_data_pin_config[] = {
-	AT91_PIN_PE13, AT91_PIN_PE14, AT91_PIN_PE17, AT91_PIN_PE18,
-	AT91_PIN_PE19, AT91_PIN_PE20, AT91_PIN_PE21, AT91_PIN_PE22
+//Panels selectable with the panel parameter when the board code doesn't
+//describe its own.
+static const struct ssd1963_panel ssd1963_panels[] = {
+	{
+		//Newhaven NHD-5.7-320240WFB-CTXI-T1
+		.name		= "320x240",
+		.xres		= 320,
+		.yres		= 240,
+		.width_mm	= 115,
+		.height_mm	= 86,
+		.pclk_khz	= 6400,
+		.hsync_len	= 16,
+		.hback_porch	= 52,
+		.hfront_porch	= 53,
+		.vsync_len	= 8,
+		.vback_porch	= 11,
+		.vfront_porch	= 6,
+		.lcd_mode	= 0x0c,
+	}, {
+		//4.3" 480x272 TFT modules
+		.name		= "480x272",
+		.xres		= 480,
+		.yres		= 272,
+		.width_mm	= 95,
+		.height_mm	= 54,
+		.pclk_khz	= 9000,
+		.hsync_len	= 41,
+		.hback_porch	= 2,
+		.hfront_porch	= 2,
+		.vsync_len	= 10,
+		.vback_porch	= 2,
+		.vfront_porch	= 2,
+		.lcd_mode	= 0x20,
+	}, {
+		//7" 800x480 TFT modules
+		.name		= "800x480",
+		.xres		= 800,
+		.yres		= 480,
+		.width_mm	= 154,
+		.height_mm	= 86,
+		.pclk_khz	= 33300,
+		.hsync_len	= 20,
+		.hback_porch	= 26,
+		.hfront_porch	= 210,
+		.vsync_len	= 10,
+		.vback_porch	= 13,
+		.vfront_porch	= 22,
+		.lcd_mode	= 0x20,
+	},
 };
 
-static unsigned int nhd_gpio_pin_config[] = {
-
-	AT91_PIN_PE0, // RESET
-	AT91_PIN_PE2, // DC
-	AT91_PIN_PE5, // CLK
-	AT91_PIN_PE6,  // RD
-	AT91_PIN_PE1  // WR
-
+static char *panel_name = "320x240";
+module_param_named(panel, panel_name, charp, 0444);
+MODULE_PARM_DESC(panel, "Built-in panel for devices without platform_data: 320x240, 480x272 or 800x480");
+
+//The PLL is left at its reset configuration; this is the frequency the
+//pixel clock is divided from.
+#define SSD1963_PLL_KHZ			113329
+
+//Wiring of the CoreWind IPC-SAM9G45 carrier, used when the board code does
+//not pass its own ssd1963_platform_data.
+static const struct ssd1963_platform_data ssd1963_default_pdata = {
+	.data_pins = {
+		AT91_PIN_PE13, AT91_PIN_PE14, AT91_PIN_PE17, AT91_PIN_PE18,
+		AT91_PIN_PE19, AT91_PIN_PE20, AT91_PIN_PE21, AT91_PIN_PE22
+	},
+	.reset_pin	= AT91_PIN_PE27,
+	.dc_pin		= AT91_PIN_PE10,
+	.rd_pin		= AT91_PIN_PE12,
+	.wr_pin		= AT91_PIN_PE11,
+	.cs_pin		= AT91_PIN_PE26,
 };
 
 struct ssd1963_page {
@@ -45,452 +179,1543 @@ struct ssd1963_page {
 	unsigned short y;
 	unsigned long *buffer;
 	unsigned short len;
-	int must_update;
+};
+
+//Console text cells are 8 pixels wide and up to SSD1963_GLYPH_ROWS high;
+//the ring holds the cells drawn since the last flush, and the cache the
+//panel format pixels of 1 << SSD1963_GLYPH_ORDER of them.
+#define SSD1963_GLYPH_ROWS		32
+#define SSD1963_GLYPH_RING		1024
+#define SSD1963_GLYPH_ORDER		8
+
+//A cell drawn in fg and bg, framebuffer pixel values; bits has one byte
+//per row, leftmost pixel in the top bit.
+struct ssd1963_glyph {
+	unsigned short x;
+	unsigned short y;
+	unsigned short rows;
+	u32 fg;
+	u32 bg;
+	u8 bits[SSD1963_GLYPH_ROWS];
+};
+
+struct ssd1963_glyph_entry {
+	unsigned short rows;
+	u32 fg;
+	u32 bg;
+	u8 bits[SSD1963_GLYPH_ROWS];
+	u8 pixels[8 * SSD1963_GLYPH_ROWS * 3];
+};
+
+//An overlay as set through SSD1963IO_SET_SPRITE; gen counts image changes.
+struct ssd1963_overlay {
+	int x;
+	int y;
+	unsigned int width;
+	unsigned int height;
+	u32 key;
+	int visible;
+	unsigned int gen;
+	void *pixels;
 };
 
 struct ssd1963 {
 	struct device *dev;
 	volatile unsigned short *ctrl_io;
 	volatile unsigned short *data_io;
+	struct resource *ctrl_req;
+	struct resource *data_req;
 	struct fb_info *info;
+	struct fb_deferred_io defio;
+	struct kthread_worker flush_worker;
+	struct kthread_work flush_work;
+	struct task_struct *flush_thread;
+	struct timer_list flush_timer;
+	int flush_prio;
+	struct ssd1963_platform_data pins;
+	struct ssd1963_panel panel;
 	unsigned int pages_count;
 	struct ssd1963_page *pages;
+	//Copy of what the panel currently shows, in framebuffer layout.
+	void *shadow;
+	//Cost of opening a window, in pixels of data that could have been
+	//sent instead.
+	unsigned int window_cost;
+	//Framebuffer to controller pixel format conversion, and one row of
+	//converted pixels.
+	void (*convert)(struct ssd1963 *item, u8 *dst, const void *src,
+			unsigned int count);
+	u8 *txbuf;
+	//Data lines in use, see struct ssd1963_platform_data.
+	unsigned int bus_width;
+	//Colors of an 8 bpp framebuffer as 0xRRGGBB. palette_changed tells
+	//the flush thread that what the panel shows no longer matches the
+	//shadow.
+	u32 palette[256];
+	atomic_t palette_changed;
+	//Pages waiting for the flush thread. Drawing paths only ever set bits
+	//here; the flush thread swaps whole words out into flush_pages, so
+	//neither side needs a lock.
+	unsigned long *dirty;
+	unsigned long *flush_pages;
+	//Pages of the priority regions, flushed ahead of the rest from
+	//flush_urgent; damage to them waits prio_delay jiffies if that's set.
+	unsigned long *prio_pages;
+	unsigned long *flush_urgent;
+	unsigned long prio_delay;
+	//Rotation in degrees clockwise. When it's done in software, panel
+	//pixel (x, y) is shadow pixel rot_origin + x * rot_dx + y * rot_dy,
+	//and rotbuf holds SSD1963_ROT_ROWS panel rows gathered that way.
+	int rotate;
+	bool rot_soft;
+	long rot_origin;
+	long rot_dx;
+	long rot_dy;
+	void *rotbuf;
+	//Console cells on their way to the flush thread. fbcon only draws
+	//under the console lock, so imageblit is the one writer of
+	//glyph_head and the flush thread the one writer of glyph_tail.
+	//glyph_line collects a run of cells in panel format, one row of
+	//the widest orientation per pixel row.
+	struct ssd1963_glyph *glyph_ring;
+	unsigned int glyph_head;
+	unsigned int glyph_tail;
+	struct ssd1963_glyph_entry *glyph_cache;
+	u8 *glyph_line;
+	//Overlays as last set, under sprite_lock, and the copy the flush
+	//thread composes rows with, taken at the start of every flush.
+	//overlay_row holds one composed framebuffer row.
+	struct ssd1963_overlay sprites[SSD1963_SPRITES];
+	struct ssd1963_overlay flush_sprites[SSD1963_SPRITES];
+	spinlock_t sprite_lock;
+	void *sprite_pixels;
+	void *overlay_row;
+	//First and last page holding each framebuffer row.
+	unsigned short *row_first_page;
+	unsigned short *row_last_page;
+	//New mmaps skip write fault tracking, set through SSD1963IO_SET_TRACKING.
+	int untracked;
+	int (*defio_mmap)(struct fb_info *info, struct vm_area_struct *vma);
+	//This panel's copy of ssd1963_fbops; deferred io patches fb_mmap in it.
+	struct fb_ops fbops;
+	//Flushes started and finished, and when the last one finished; for
+	//SSD1963IO_FLUSH_WAIT.
+	u32 flush_started;
+	u32 flush_seq;
+	u64 flush_done_ns;
+	spinlock_t flush_lock;
+	wait_queue_head_t flush_wq;
+	//SSD1963_ORDER_*, and the rows of a flush in the order they're found.
+	unsigned int flush_order;
+	unsigned short *flush_rows;
+	//Flush rate limit and when the next flush may start.
+	unsigned int max_fps;
+	unsigned long next_flush;
+	//Set by ssd1963_flush_stop(); the flush no longer rearms the timer.
+	int flush_stopping;
+	//Updates handed in by drawing paths, how many joined damage already
+	//waiting for a flush, and how many overwrote some of it before it
+	//reached the panel. pending is set from the first update to the
+	//flush that takes it.
+	atomic_t frames;
+	atomic_t coalesced;
+	atomic_t dropped;
+	atomic_t pending;
 	unsigned long pseudo_palette[25];
 };
 
-static void nhd_write_data(int command, unsigned short value)
+static void nhd_write_data(struct ssd1963 *item, int command, unsigned short value)
 {
-	int i, j, bank;
-	at91_set_gpio_output(AT91_PIN_PE12, 1); //R/D
+	int i;
+	at91_set_gpio_output(item->pins.rd_pin, 1); //R/D
 
-	for (i=0; i<ARRAY_SIZE(nhd_data_pin_config); i++)
-		at91_set_gpio_output(nhd_data_pin_config[i], (value>>i)&0x01);
+	for (i = 0; i < item->bus_width; i++)
+		at91_set_gpio_output(item->pins.data_pins[i], (value>>i)&0x01);
 
 	if (command)
-		at91_set_gpio_output(AT91_PIN_PE10, 0); //D/C
+		at91_set_gpio_output(item->pins.dc_pin, 0); //D/C
 	else
-		at91_set_gpio_output(AT91_PIN_PE10, 1); //D/C
+		at91_set_gpio_output(item->pins.dc_pin, 1); //D/C
 
-	at91_set_gpio_output(AT91_PIN_PE11, 0); //WR
-	at91_set_gpio_output(AT91_PIN_PE26, 0); //CS
-	at91_set_gpio_output(AT91_PIN_PE26, 1); //CS
-	at91_set_gpio_output(AT91_PIN_PE11, 1); //WR
+	at91_set_gpio_output(item->pins.wr_pin, 0); //WR
+	at91_set_gpio_output(item->pins.cs_pin, 0); //CS
+	at91_set_gpio_output(item->pins.cs_pin, 1); //CS
+	at91_set_gpio_output(item->pins.wr_pin, 1); //WR
 }
 
-static void nhd_init_gpio_regs(void)
+static void nhd_init_gpio_regs(struct ssd1963 *item)
 {
 	int i;
 
-	for (i = 0; i < ARRAY_SIZE(nhd_data_pin_config); i++) {
-		at91_set_gpio_output(nhd_data_pin_config[i], 1);
+	for (i = 0; i < item->bus_width; i++) {
+		at91_set_gpio_output(item->pins.data_pins[i], 1);
 	}
-	at91_set_gpio_output(AT91_PIN_PE11, 1); //WR
-	at91_set_gpio_output(AT91_PIN_PE26, 1); //CS
-	at91_set_gpio_output(AT91_PIN_PE12, 1); //RD
-	at91_set_gpio_output(AT91_PIN_PE10, 1); //D/C
-	at91_set_gpio_output(AT91_PIN_PE27, 1); //RESET
+	at91_set_gpio_output(item->pins.wr_pin, 1); //WR
+	at91_set_gpio_output(item->pins.cs_pin, 1); //CS
+	at91_set_gpio_output(item->pins.rd_pin, 1); //RD
+	at91_set_gpio_output(item->pins.dc_pin, 1); //D/C
+	at91_set_gpio_output(item->pins.reset_pin, 1); //RESET
 }
 
-static void nhd_write_to_register (unsigned char reg ,unsigned char value)
+//Claim every line of the bus so that two panels can't be configured onto the
+//same pins by accident.
+static int ssd1963_request_gpios(struct ssd1963 *item)
 {
-	nhd_write_data(NHD_COMMAND, reg);
-	nhd_write_data(NHD_DATA, value);
+	unsigned int pins[SSD1963_DATA_PINS + 5];
+	int i, n = item->bus_width, ret;
+
+	memcpy(pins, item->pins.data_pins, n * sizeof(pins[0]));
+	pins[n++] = item->pins.reset_pin;
+	pins[n++] = item->pins.dc_pin;
+	pins[n++] = item->pins.rd_pin;
+	pins[n++] = item->pins.wr_pin;
+	pins[n++] = item->pins.cs_pin;
+
+	for (i = 0; i < n; i++) {
+		ret = gpio_request_one(pins[i], GPIOF_OUT_INIT_HIGH,
+				       dev_name(item->dev));
+		if (ret) {
+			dev_err(item->dev, "%s: unable to request gpio %u\n",
+				__func__, pins[i]);
+			while (--i >= 0)
+				gpio_free(pins[i]);
+			return ret;
+		}
+	}
+
+	return 0;
 }
 
-static inline void nhd_send_rgb_data (unsigned long color)
+static void ssd1963_free_gpios(struct ssd1963 *item)
 {
-	nhd_write_data(NHD_DATA,((color)>>16));	    //red
-	nhd_write_data(NHD_DATA,((color)>>8));	    //green
-	nhd_write_data(NHD_DATA,(color));           //blue
+	int i;
+
+	for (i = 0; i < item->bus_width; i++)
+		gpio_free(item->pins.data_pins[i]);
+	gpio_free(item->pins.reset_pin);
+	gpio_free(item->pins.dc_pin);
+	gpio_free(item->pins.rd_pin);
+	gpio_free(item->pins.wr_pin);
+	gpio_free(item->pins.cs_pin);
 }
 
-static void nhd_set_window(unsigned int s_x, unsigned int e_x, unsigned int s_y, unsigned int e_y)
+//Undo whatever part of the register mapping probe got through.
+static void ssd1963_release_io(struct ssd1963 *item)
 {
-	nhd_write_data(NHD_COMMAND, 0x2a);			//SET page address
-	nhd_write_data(NHD_DATA, (s_x)>>8);			//SET start page address=0
-	nhd_write_data(NHD_DATA, s_x);
-	nhd_write_data(NHD_DATA, (e_x)>>8);			//SET end page address=319
-	nhd_write_data(NHD_DATA, e_x);
+	if (item->data_io)
+		iounmap(item->data_io);
+	if (item->data_req)
+		release_mem_region(item->data_req->start,
+				   item->data_req->end - item->data_req->start + 1);
+	if (item->ctrl_io)
+		iounmap(item->ctrl_io);
+	if (item->ctrl_req)
+		release_mem_region(item->ctrl_req->start,
+				   item->ctrl_req->end - item->ctrl_req->start + 1);
+}
 
-	nhd_write_data(NHD_COMMAND, 0x2b);			//SET column address
-	nhd_write_data(NHD_DATA, (s_y)>>8);			//SET start column address=0
-	nhd_write_data(NHD_DATA, s_y);
-	nhd_write_data(NHD_DATA, (e_y)>>8);			//SET end column address=239
-	nhd_write_data(NHD_DATA, e_y);
+static void nhd_write_to_register(struct ssd1963 *item, unsigned char reg ,unsigned char value)
+{
+	nhd_write_data(item, NHD_COMMAND, reg);
+	nhd_write_data(item, NHD_DATA, value);
+}
 
+//Put one word on the data lines and strobe WR. *prev is the word already
+//on the bus, so only the wired lines whose level differs from it are
+//driven. Words are at most 16 bits wide, so ~0U can't be a real previous
+//word: it starts a burst and drives every wired line.
+static __always_inline void nhd_put_word(struct ssd1963 *item,
+					 unsigned int word, unsigned int *prev)
+{
+	unsigned int bit;
+	unsigned int mask = (1U << item->bus_width) - 1;
+	unsigned int changed = *prev == ~0U ? mask : (word ^ *prev) & mask;
+
+	for (bit = 0; changed; bit++, changed >>= 1) {
+		if (changed & 0x01)
+			at91_set_gpio_value(item->pins.data_pins[bit],
+					    (word >> bit) & 0x01);
+	}
+	*prev = word;
+
+	at91_set_gpio_value(item->pins.wr_pin, 0); //WR
+	at91_set_gpio_value(item->pins.wr_pin, 1); //WR
 }
 
-static void nhd_clear_graph(void)
+//Stream count bytes of R, G, B pixels, e.g. after a 0x2c memory write, in
+//as many bus cycles as the wiring needs: one per byte on 8 lines, two per
+//pixel on 9 (6-6-6) and 12, one per pixel on 16 (5-6-5). DC, RD and CS
+//don't change during the burst, so they're set once and only WR is
+//strobed per word.
+static void nhd_write_pixels(struct ssd1963 *item, const u8 *buffer,
+			     unsigned int count)
+{
+	unsigned int i, prev;
+	u8 r, g, b;
+
+	if (!count)
+		return;
+
+	at91_set_gpio_value(item->pins.rd_pin, 1); //R/D
+	at91_set_gpio_value(item->pins.dc_pin, 1); //D/C
+	at91_set_gpio_value(item->pins.cs_pin, 0); //CS
+
+	//The lines still hold the 0x2c command or the last burst, so the
+	//first word sets all of them.
+	prev = ~0U;
+	switch (item->bus_width) {
+	case 9:
+		for (i = 0; i + 3 <= count; i += 3) {
+			r = buffer[i] >> 2;
+			g = buffer[i + 1] >> 2;
+			b = buffer[i + 2] >> 2;
+			nhd_put_word(item, (r << 3) | (g >> 3), &prev);
+			nhd_put_word(item, ((g & 0x07) << 6) | b, &prev);
+		}
+		break;
+	case 12:
+		for (i = 0; i + 3 <= count; i += 3) {
+			r = buffer[i];
+			g = buffer[i + 1];
+			b = buffer[i + 2];
+			nhd_put_word(item, (r << 4) | (g >> 4), &prev);
+			nhd_put_word(item, ((g & 0x0f) << 8) | b, &prev);
+		}
+		break;
+	case 16:
+		for (i = 0; i + 3 <= count; i += 3) {
+			r = buffer[i];
+			g = buffer[i + 1];
+			b = buffer[i + 2];
+			nhd_put_word(item, ((r & 0xf8) << 8) |
+					   ((g & 0xfc) << 3) | (b >> 3), &prev);
+		}
+		break;
+	default:
+		for (i = 0; i < count; i++)
+			nhd_put_word(item, buffer[i], &prev);
+		break;
+	}
+
+	at91_set_gpio_value(item->pins.cs_pin, 1); //CS
+}
+
+//RD low to data valid, with some margin.
+#define SSD1963_READ_NS			100
+
+//Send command cmd and read count bytes back on D0..D7. The data lines are
+//inputs for the duration of the read and are driven high again afterwards.
+static void nhd_read_command(struct ssd1963 *item, u8 cmd, u8 *buf,
+			     unsigned int count)
+{
+	unsigned int i, bit;
+
+	nhd_write_data(item, NHD_COMMAND, cmd);
+	for (bit = 0; bit < item->bus_width; bit++)
+		at91_set_gpio_input(item->pins.data_pins[bit], 0);
+
+	at91_set_gpio_value(item->pins.dc_pin, 1); //D/C
+	at91_set_gpio_value(item->pins.cs_pin, 0); //CS
+	for (i = 0; i < count; i++) {
+		at91_set_gpio_value(item->pins.rd_pin, 0); //RD
+		ndelay(SSD1963_READ_NS);
+		buf[i] = 0;
+		for (bit = 0; bit < 8; bit++)
+			buf[i] |= at91_get_gpio_value(
+					item->pins.data_pins[bit]) << bit;
+		at91_set_gpio_value(item->pins.rd_pin, 1); //RD
+	}
+	at91_set_gpio_value(item->pins.cs_pin, 1); //CS
+
+	for (bit = 0; bit < item->bus_width; bit++)
+		at91_set_gpio_output(item->pins.data_pins[bit], 1);
+}
+
+static void nhd_set_window(struct ssd1963 *item, unsigned int s_x, unsigned int e_x, unsigned int s_y, unsigned int e_y)
+{
+	nhd_write_data(item, NHD_COMMAND, 0x2a);			//SET page address
+	nhd_write_data(item, NHD_DATA, (s_x)>>8);			//SET start page address=0
+	nhd_write_data(item, NHD_DATA, s_x);
+	nhd_write_data(item, NHD_DATA, (e_x)>>8);			//SET end page address=319
+	nhd_write_data(item, NHD_DATA, e_x);
+
+	nhd_write_data(item, NHD_COMMAND, 0x2b);			//SET column address
+	nhd_write_data(item, NHD_DATA, (s_y)>>8);			//SET start column address=0
+	nhd_write_data(item, NHD_DATA, s_y);
+	nhd_write_data(item, NHD_DATA, (e_y)>>8);			//SET end column address=239
+	nhd_write_data(item, NHD_DATA, e_y);
+
+}
+
+static void nhd_clear_graph(struct ssd1963 *item)
 {
 	int i;
-	int length=76800;
+	int length = item->panel.yres;
 
-	nhd_set_window(0x0000, 0x013f, 0x0000, 0x00ef);
-	nhd_write_data(NHD_COMMAND, 0x2c);
+	nhd_set_window(item, 0, item->panel.xres - 1, 0, item->panel.yres - 1);
+	nhd_write_data(item, NHD_COMMAND, 0x2c);
 
+	//One black row at a time from the transmit buffer.
+	memset(item->txbuf, 0, item->panel.xres * 3);
 	for(i=0; i<length; i++) {
-		nhd_send_rgb_data(0x00000000);
+		nhd_write_pixels(item, item->txbuf, item->panel.xres * 3);
 	}
 }
 
-static void ssd1963_copy(struct ssd1963 *item, unsigned int index)
+//Kick the flush thread once delay has passed, or earlier if it's already
+//due. Further damage arriving in the meantime is picked up by the same flush.
+static void ssd1963_schedule_flush_in(struct ssd1963 *item,
+				      unsigned long delay)
 {
-	unsigned short x;
-	unsigned short y;
-	unsigned long *buffer;
-	unsigned int len;
-	unsigned int count;
+	unsigned long when = jiffies + delay;
 
-	unsigned short startx;
-	unsigned short endx;
-	unsigned short starty;
-	unsigned short endy;
-	unsigned short offset;
+	if (!timer_pending(&item->flush_timer) ||
+	    time_before(when, item->flush_timer.expires))
+		mod_timer(&item->flush_timer, when);
+}
 
+static void ssd1963_schedule_flush(struct ssd1963 *item)
+{
+	ssd1963_schedule_flush_in(item, item->defio.delay);
+}
 
-	x = item->pages[index].x;
-	y = item->pages[index].y;
-	buffer = item->pages[index].buffer;
-	len = item->pages[index].len;
-	dev_dbg(item->dev,
-		"%s: page[%u]: x=%3hu y=%3hu buffer=0x%p len=%3hu\n",
-		__func__, index, x, y, buffer, len);
+static void ssd1963_flush_timer(unsigned long data)
+{
+	struct ssd1963 *item = (struct ssd1963 *)data;
 
-	switch (index%5) {
+	queue_kthread_work(&item->flush_worker, &item->flush_work);
+}
 
-	case 0:
-#ifdef LCD_MODE_565RGB
-		offset = 0;
-		startx = x;
-		starty = y;
-		endx   = 319;
-		endy   = y+6;
-		len    = 1920;
-#else
-		offset = 0;
-		startx = x;
-		starty = y;
-		endx   = 319;
-		endy   = y+2;
-		len    = 960;
-#endif
-		nhd_set_window(startx, endx, starty, endy);
-		nhd_write_data(NHD_COMMAND, 0x2c);
+//Mark a page for the next flush. Safe from any context, including fbcon
+//drawing with interrupts off. Returns whether it was already waiting.
+static inline int ssd1963_mark_page(struct ssd1963 *item, unsigned int index)
+{
+	return test_and_set_bit(index, item->dirty);
+}
 
-		for (count = 0; count < len; count++) {
-			nhd_write_data(NHD_DATA,(unsigned char)((buffer[count+offset])>>16));	    //red
-			nhd_write_data(NHD_DATA,(unsigned char)((buffer[count+offset])>>8));	    //green
-			nhd_write_data(NHD_DATA,(unsigned char)(buffer[count+offset]));		    //blue
-		}
+//Account for one update from a drawing path, superseded if it overwrote
+//damage that hasn't been sent yet.
+static void ssd1963_count_frame(struct ssd1963 *item, int superseded)
+{
+	atomic_inc(&item->frames);
+	if (atomic_xchg(&item->pending, 1))
+		atomic_inc(&item->coalesced);
+	if (superseded)
+		atomic_inc(&item->dropped);
+}
 
-		offset = len;
+static void ssd1963_update_all(struct ssd1963 *item)
+{
+	unsigned short i;
+	for (i = 0; i < item->pages_count; i++) {
+		ssd1963_mark_page(item, i);
+	}
+	ssd1963_schedule_flush(item);
+}
 
-		startx = x;
-		starty = y+3;
-		endx   = x+63;
-		endy   = y+3;
-		len	   = 64;
-		nhd_set_window(startx, endx, starty, endy);
-		nhd_write_data(NHD_COMMAND, 0x2c);
+//Setting up a window costs 11 bus bytes, about four pixels worth of data at
+//three bytes per pixel. Unchanged gaps shorter than that are cheaper to send
+//along than to skip with a new window. ssd1963_calibrate() replaces this
+//with what the bus actually does once the panel is up.
+#define SSD1963_WINDOW_COST		4
+
+//Empty windows timed by ssd1963_calibrate().
+#define SSD1963_CAL_WINDOWS		64
+
+//What sending a flush run by run would take, found by a first pass over the
+//damage that only compares. Adjacent full rows count as one window, like
+//ssd1963_send_run() sends them. The bounding box is [x0, x1) x [y0, y1).
+struct ssd1963_plan {
+	unsigned int windows;
+	unsigned int pixels;
+	unsigned int next_full;
+	unsigned int x0;
+	unsigned int x1;
+	unsigned int y0;
+	unsigned int y1;
+};
 
-		for (count = 0; count < len; count++) {
-			nhd_write_data(NHD_DATA,(unsigned char)((buffer[count+offset])>>16));	    //red
-			nhd_write_data(NHD_DATA,(unsigned char)((buffer[count+offset])>>8));		//green
-			nhd_write_data(NHD_DATA,(unsigned char)(buffer[count+offset]));			//blue
-		}
+//Rows that changed across the whole width, waiting to go out as one window.
+//Rotated panels collect any damage here as a rectangle, x and width wide.
+//With plan set, runs are only accounted for there and nothing is sent.
+struct ssd1963_batch {
+	unsigned int y;
+	unsigned int rows;
+	unsigned int x;
+	unsigned int width;
+	struct ssd1963_plan *plan;
+};
 
-		break;
+//Panel rows gathered per pass of the software rotation. The source lines
+//they read and the destination lines they write both stay in the D-cache.
+#define SSD1963_ROT_ROWS		8
 
-	case 1:
-		offset = 0;
-		startx = x;
-		starty = y;
-		endx   = 319;
-		endy   = y;
-		len    = 256;
-		nhd_set_window(startx, endx, starty, endy);
-		nhd_write_data(NHD_COMMAND, 0x2c);
-
-		for (count = 0; count < len; count++) {
-			nhd_write_data(NHD_DATA,(unsigned char)((buffer[count+offset])>>16));	    //red
-			nhd_write_data(NHD_DATA,(unsigned char)((buffer[count+offset])>>8));		//green
-			nhd_write_data(NHD_DATA,(unsigned char)(buffer[count+offset]));			//blue
-		}
+//Pixel converters turn count framebuffer pixels into the R, G, B byte
+//stream the controller takes in 8-8-8 mode. The right one is picked once
+//for the framebuffer format, see ssd1963_select_convert().
+static __always_inline u32 ssd1963_8888_pixel(u32 p, const bool bgr)
+{
+	if (bgr)
+		return ((p & 0xff) << 16) | (p & 0xff00) | ((p >> 16) & 0xff);
+	return p & 0xffffff;
+}
 
-		offset += len;
+static __always_inline void ssd1963_convert_8888(u8 *dst, const u32 *src,
+						 unsigned int count,
+						 const bool bgr)
+{
+	__be32 *out = (__be32 *)dst;
+	u32 p0, p1, p2, p3;
+
+	//Four pixels fit exactly into three words of output.
+	for (; count >= 4; count -= 4, src += 4) {
+		p0 = ssd1963_8888_pixel(src[0], bgr);
+		p1 = ssd1963_8888_pixel(src[1], bgr);
+		p2 = ssd1963_8888_pixel(src[2], bgr);
+		p3 = ssd1963_8888_pixel(src[3], bgr);
+		*out++ = cpu_to_be32((p0 << 8) | (p1 >> 16));
+		*out++ = cpu_to_be32((p1 << 16) | (p2 >> 8));
+		*out++ = cpu_to_be32((p2 << 24) | p3);
+	}
 
-		startx = 0;
-		starty = y+1;
-		endx   = 319;
-		endy   = y+2;
-		len	   = 640;
-		nhd_set_window(startx, endx, starty, endy);
-		nhd_write_data(NHD_COMMAND, 0x2c);
+	dst = (u8 *)out;
+	for (; count; count--) {
+		p0 = ssd1963_8888_pixel(*src++, bgr);
+		*dst++ = p0 >> 16;
+		*dst++ = p0 >> 8;
+		*dst++ = p0;
+	}
+}
 
-		for (count = 0; count < len; count++) {
-			nhd_write_data(NHD_DATA,(unsigned char)((buffer[count+offset])>>16));	    //red
-			nhd_write_data(NHD_DATA,(unsigned char)((buffer[count+offset])>>8));		//green
-			nhd_write_data(NHD_DATA,(unsigned char)(buffer[count+offset]));			//blue
-		}
+static __always_inline void ssd1963_convert_565(u8 *dst, const u16 *src,
+						unsigned int count,
+						const bool bgr)
+{
+	u32 p, r, g, b;
+
+	for (; count; count--) {
+		p = *src++;
+		r = (p >> 11) & 0x1f;
+		g = (p >> 5) & 0x3f;
+		b = p & 0x1f;
+		if (bgr)
+			swap(r, b);
+		*dst++ = (r << 3) | (r >> 2);
+		*dst++ = (g << 2) | (g >> 4);
+		*dst++ = (b << 3) | (b >> 2);
+	}
+}
+
+static void ssd1963_xrgb8888_to_rgb888(struct ssd1963 *item, u8 *dst,
+				       const void *src, unsigned int count)
+{
+	ssd1963_convert_8888(dst, src, count, false);
+}
+
+static void ssd1963_xbgr8888_to_rgb888(struct ssd1963 *item, u8 *dst,
+				       const void *src, unsigned int count)
+{
+	ssd1963_convert_8888(dst, src, count, true);
+}
 
-		offset += len;
+static void ssd1963_rgb565_to_rgb888(struct ssd1963 *item, u8 *dst,
+				     const void *src, unsigned int count)
+{
+	ssd1963_convert_565(dst, src, count, false);
+}
+
+static void ssd1963_bgr565_to_rgb888(struct ssd1963 *item, u8 *dst,
+				     const void *src, unsigned int count)
+{
+	ssd1963_convert_565(dst, src, count, true);
+}
+
+static void ssd1963_pal8_to_rgb888(struct ssd1963 *item, u8 *dst,
+				   const void *src, unsigned int count)
+{
+	const u8 *index = src;
+	u32 p;
+
+	for (; count; count--) {
+		p = item->palette[*index++];
+		*dst++ = p >> 16;
+		*dst++ = p >> 8;
+		*dst++ = p;
+	}
+}
+
+static int ssd1963_select_convert(struct ssd1963 *item)
+{
+	struct fb_var_screeninfo *var = &item->info->var;
+	bool bgr = var->blue.offset > var->red.offset;
+
+	switch (var->bits_per_pixel) {
+	case 32:
+		item->convert = bgr ? ssd1963_xbgr8888_to_rgb888 :
+				      ssd1963_xrgb8888_to_rgb888;
+		return 0;
+	case 16:
+		item->convert = bgr ? ssd1963_bgr565_to_rgb888 :
+				      ssd1963_rgb565_to_rgb888;
+		return 0;
+	case 8:
+		item->convert = ssd1963_pal8_to_rgb888;
+		return 0;
+	default:
+		dev_err(item->dev, "%s: unsupported depth %u\n",
+			__func__, var->bits_per_pixel);
+		return -EINVAL;
+	}
+}
 
-		startx = 0;
-		starty = y+3;
-		endx   = 127;
-		endy   = y+3;
-		len	   = 128;
-		nhd_set_window(startx, endx, starty, endy);
-		nhd_write_data(NHD_COMMAND, 0x2c);
+//Send width x rows pixels at (x, y) from the shadow, converting one row at
+//a time into the transmit buffer.
+static void ssd1963_send_window(struct ssd1963 *item, unsigned int x,
+				unsigned int y, unsigned int width,
+				unsigned int rows)
+{
+	unsigned int line_length = item->info->fix.line_length;
+	const void *src = item->shadow + y * line_length +
+			  x * (item->info->var.bits_per_pixel / 8);
+
+	nhd_set_window(item, x, x + width - 1, y, y + rows - 1);
+	nhd_write_data(item, NHD_COMMAND, 0x2c);
+	for (; rows; rows--, src += line_length) {
+		item->convert(item, item->txbuf, src, width);
+		nhd_write_pixels(item, item->txbuf, width * 3);
+	}
+}
 
-		for (count = 0; count < len; count++) {
-			nhd_write_data(NHD_DATA,(unsigned char)((buffer[count+offset])>>16));	    //red
-			nhd_write_data(NHD_DATA,(unsigned char)((buffer[count+offset])>>8));		//green
-			nhd_write_data(NHD_DATA,(unsigned char)(buffer[count+offset]));			//blue
+//Copy rows panel rows of width pixels, starting at shadow pixel origin,
+//into rotbuf. For each panel column the rows are read together, so a 90 or
+//270 degree transpose walks a handful of neighbouring pixels per source
+//line instead of one pixel per line across the whole frame.
+static __always_inline void ssd1963_rotate_rows(void *dst, const void *src,
+						long origin, long dx, long dy,
+						unsigned int width,
+						unsigned int rows,
+						const unsigned int cpp)
+{
+	unsigned int x, r;
+	long p;
+
+	for (x = 0; x < width; x++, origin += dx) {
+		for (r = 0, p = origin; r < rows; r++, p += dy) {
+			if (cpp == 4)
+				((u32 *)dst)[r * width + x] =
+					((const u32 *)src)[p];
+			else if (cpp == 2)
+				((u16 *)dst)[r * width + x] =
+					((const u16 *)src)[p];
+			else
+				((u8 *)dst)[r * width + x] =
+					((const u8 *)src)[p];
 		}
+	}
+}
 
+//Send the framebuffer rectangle width x rows at (x, y) to where it lands
+//on the rotated panel, as a single window.
+static void ssd1963_send_rotated(struct ssd1963 *item, unsigned int x,
+				 unsigned int y, unsigned int width,
+				 unsigned int rows)
+{
+	unsigned int xres = item->info->var.xres;
+	unsigned int yres = item->info->var.yres;
+	unsigned int cpp = item->info->var.bits_per_pixel / 8;
+	unsigned int px, py, pw, ph, n, r;
+	long origin;
+
+	switch (item->rotate) {
+	case 90:
+		px = yres - (y + rows);
+		py = x;
+		pw = rows;
+		ph = width;
 		break;
+	case 180:
+		px = xres - (x + width);
+		py = yres - (y + rows);
+		pw = width;
+		ph = rows;
+		break;
+	default:
+		px = y;
+		py = xres - (x + width);
+		pw = rows;
+		ph = width;
+		break;
+	}
 
-	case 2:
-		offset = 0;
-		startx = x;
-		starty = y;
-		endx   = 319;
-		endy   = y;
-		len    = 192;
-		nhd_set_window(startx, endx, starty, endy);
-		nhd_write_data(NHD_COMMAND, 0x2c);
-
-		for (count = 0; count < len; count++) {
-			nhd_write_data(NHD_DATA,(unsigned char)((buffer[count+offset])>>16));	    //red
-			nhd_write_data(NHD_DATA,(unsigned char)((buffer[count+offset])>>8));		//green
-			nhd_write_data(NHD_DATA,(unsigned char)(buffer[count+offset]));			//blue
+	nhd_set_window(item, px, px + pw - 1, py, py + ph - 1);
+	nhd_write_data(item, NHD_COMMAND, 0x2c);
+	for (; ph; ph -= n, py += n) {
+		n = min_t(unsigned int, ph, SSD1963_ROT_ROWS);
+		origin = item->rot_origin + (long)px * item->rot_dx +
+			 (long)py * item->rot_dy;
+		if (cpp == 4)
+			ssd1963_rotate_rows(item->rotbuf, item->shadow, origin,
+					    item->rot_dx, item->rot_dy, pw, n, 4);
+		else if (cpp == 2)
+			ssd1963_rotate_rows(item->rotbuf, item->shadow, origin,
+					    item->rot_dx, item->rot_dy, pw, n, 2);
+		else
+			ssd1963_rotate_rows(item->rotbuf, item->shadow, origin,
+					    item->rot_dx, item->rot_dy, pw, n, 1);
+		for (r = 0; r < n; r++) {
+			item->convert(item, item->txbuf,
+				      item->rotbuf + r * pw * cpp, pw);
+			nhd_write_pixels(item, item->txbuf, pw * 3);
 		}
+	}
+}
+
+//Send a framebuffer rectangle from the shadow, whichever way the panel is
+//mounted.
+static void ssd1963_send_rect(struct ssd1963 *item, unsigned int x,
+			      unsigned int y, unsigned int width,
+			      unsigned int rows)
+{
+	if (item->rot_soft)
+		ssd1963_send_rotated(item, x, y, width, rows);
+	else
+		ssd1963_send_window(item, x, y, width, rows);
+}
+
+static void ssd1963_send_batch(struct ssd1963 *item, struct ssd1963_batch *batch)
+{
+	if (batch->rows && item->rot_soft)
+		ssd1963_send_rotated(item, batch->x, batch->y, batch->width,
+				     batch->rows);
+	else if (batch->rows)
+		ssd1963_send_window(item, 0, batch->y, item->info->var.xres,
+				    batch->rows);
+	batch->rows = 0;
+}
+
+static void ssd1963_plan_run(struct ssd1963 *item, struct ssd1963_plan *plan,
+			     unsigned int y, unsigned int start,
+			     unsigned int end)
+{
+	bool full = start == 0 && end == item->info->var.xres;
 
-		offset += len;
+	if (!plan->pixels) {
+		plan->x0 = start;
+		plan->x1 = end;
+		plan->y0 = y;
+	}
+	plan->x0 = min(plan->x0, start);
+	plan->x1 = max(plan->x1, end);
+	plan->y1 = y + 1;
+	plan->pixels += end - start;
+	if (!full || plan->next_full != y)
+		plan->windows++;
+	plan->next_full = full ? y + 1 : UINT_MAX;
+}
 
-		startx = 0;
-		starty = y+1;
-		endx   = 319;
-		endy   = y+2;
-		len	   = 640;
-		nhd_set_window(startx, endx, starty, endy);
-		nhd_write_data(NHD_COMMAND, 0x2c);
+//One window over the bounding box resends the unchanged pixels inside it,
+//run by run every window is paid for. Take whichever moves less; a box that
+//covers the whole frame is a plain full frame update.
+static bool ssd1963_plan_bbox(struct ssd1963 *item, struct ssd1963_plan *plan)
+{
+	u64 runs = (u64)plan->windows * item->window_cost + plan->pixels;
+	u64 bbox = item->window_cost +
+		   (u64)(plan->x1 - plan->x0) * (plan->y1 - plan->y0);
 
-		for (count = 0; count < len; count++) {
-			nhd_write_data(NHD_DATA,(unsigned char)((buffer[count+offset])>>16));	    //red
-			nhd_write_data(NHD_DATA,(unsigned char)((buffer[count+offset])>>8));		//green
-			nhd_write_data(NHD_DATA,(unsigned char)(buffer[count+offset]));			//blue
+	return plan->windows > 1 && bbox < runs;
+}
+
+//Take the overlays as they're set now for this flush. Images are only
+//copied when they've changed.
+static void ssd1963_overlay_snapshot(struct ssd1963 *item)
+{
+	unsigned int cpp = item->info->var.bits_per_pixel / 8;
+	struct ssd1963_overlay *s, *f;
+	void *pixels;
+	unsigned int i;
+
+	spin_lock(&item->sprite_lock);
+	for (i = 0; i < SSD1963_SPRITES; i++) {
+		s = &item->sprites[i];
+		f = &item->flush_sprites[i];
+		if (f->gen != s->gen)
+			memcpy(f->pixels, s->pixels,
+			       s->width * s->height * cpp);
+		pixels = f->pixels;
+		*f = *s;
+		f->pixels = pixels;
+	}
+	spin_unlock(&item->sprite_lock);
+}
+
+//Whether any overlay covers part of the rectangle w x h at (x, y).
+static bool ssd1963_overlay_hit(struct ssd1963 *item, int x, int y,
+				unsigned int w, unsigned int h)
+{
+	const struct ssd1963_overlay *f;
+	unsigned int i;
+
+	for (i = 0; i < SSD1963_SPRITES; i++) {
+		f = &item->flush_sprites[i];
+		if (f->visible && f->x < x + (int)w && x < f->x + (int)f->width &&
+		    f->y < y + (int)h && y < f->y + (int)f->height)
+			return true;
+	}
+	return false;
+}
+
+//Framebuffer row y as the panel should show it: the row itself, or a copy
+//in overlay_row with the overlays that cross it drawn on top.
+static const void *ssd1963_overlay_row(struct ssd1963 *item, unsigned int y)
+{
+	unsigned int xres = item->info->var.xres;
+	unsigned int cpp = item->info->var.bits_per_pixel / 8;
+	const void *row = item->info->screen_base +
+			  y * item->info->fix.line_length;
+	const struct ssd1963_overlay *f;
+	const void *src;
+	unsigned int i, n;
+	int x0, x1, x;
+	u32 pixel;
+
+	for (i = SSD1963_SPRITES; i--; ) {
+		f = &item->flush_sprites[i];
+		if (!f->visible || (int)y < f->y ||
+		    (int)y >= f->y + (int)f->height)
+			continue;
+		x0 = max(f->x, 0);
+		x1 = min(f->x + (int)f->width, (int)xres);
+		if (x0 >= x1)
+			continue;
+		if (row != item->overlay_row) {
+			memcpy(item->overlay_row, row, xres * cpp);
+			row = item->overlay_row;
 		}
-		offset += len;
-
-		startx = 0;
-		starty = y+3;
-		endx   = 191;
-		endy   = y+3;
-		len	   = 192;
-		nhd_set_window(startx, endx, starty, endy);
-		nhd_write_data(NHD_COMMAND, 0x2c);
-
-		for (count = 0; count < len; count++) {
-			nhd_write_data(NHD_DATA,(unsigned char)((buffer[count+offset])>>16));	    //red
-			nhd_write_data(NHD_DATA,(unsigned char)((buffer[count+offset])>>8));		//green
-			nhd_write_data(NHD_DATA,(unsigned char)(buffer[count+offset]));			//blue
+		src = f->pixels + ((y - f->y) * f->width + x0 - f->x) * cpp;
+		for (x = x0, n = 0; x < x1; x++, n++) {
+			if (cpp == 4)
+				pixel = ((const u32 *)src)[n];
+			else if (cpp == 2)
+				pixel = ((const u16 *)src)[n];
+			else
+				pixel = ((const u8 *)src)[n];
+			if (pixel == f->key)
+				continue;
+			if (cpp == 4)
+				((u32 *)item->overlay_row)[x] = pixel;
+			else if (cpp == 2)
+				((u16 *)item->overlay_row)[x] = pixel;
+			else
+				((u8 *)item->overlay_row)[x] = pixel;
 		}
+	}
+
+	return row;
+}
+
+//Interleaved flushes send stripes of SSD1963_STRIPE_ROWS rows, every
+//SSD1963_STRIPES-th one per pass.
+#define SSD1963_STRIPE_ROWS		8
+#define SSD1963_STRIPES			4
+
+//Row orders other than top to bottom only make sense while framebuffer
+//rows are panel rows, and following the scan while they're not flipped.
+static unsigned int ssd1963_flush_order(struct ssd1963 *item)
+{
+	if (item->rot_soft ||
+	    (item->flush_order == SSD1963_ORDER_SCAN && item->rotate))
+		return SSD1963_ORDER_LINEAR;
+	return item->flush_order;
+}
 
+//Framebuffer row the panel is refreshing right now, from get_scanline
+//(0x45). The count starts at the vertical sync, so lines in the blanking
+//period before and after the picture make the next refresh start at the top.
+static unsigned int ssd1963_scan_row(struct ssd1963 *item)
+{
+	unsigned int vps = item->panel.vsync_len + item->panel.vback_porch;
+	unsigned int line;
+	u8 buf[2];
+
+	nhd_read_command(item, 0x45, buf, 2);
+	line = (buf[0] << 8) | buf[1];
+	if (line < vps || line - vps >= item->info->var.yres)
+		return 0;
+	return line - vps;
+}
+
+//Send a framebuffer rectangle from the shadow in the given row order.
+static void ssd1963_send_ordered(struct ssd1963 *item, unsigned int x,
+				 unsigned int y, unsigned int width,
+				 unsigned int rows, unsigned int order)
+{
+	unsigned int end = y + rows;
+	unsigned int pass, stripe, first, s, e;
+
+	switch (order) {
+	case SSD1963_ORDER_INTERLEAVE:
+		first = y / SSD1963_STRIPE_ROWS;
+		for (pass = 0; pass < SSD1963_STRIPES; pass++) {
+			stripe = first + (pass + SSD1963_STRIPES -
+					  first % SSD1963_STRIPES) %
+					 SSD1963_STRIPES;
+			for (; stripe * SSD1963_STRIPE_ROWS < end;
+			     stripe += SSD1963_STRIPES) {
+				s = max(stripe * SSD1963_STRIPE_ROWS, y);
+				e = min((stripe + 1) * SSD1963_STRIPE_ROWS, end);
+				ssd1963_send_rect(item, x, s, width, e - s);
+			}
+		}
 		break;
-	case 3:
-		offset = 0;
-		startx = x;
-		starty = y;
-		endx   = 319;
-		endy   = y;
-		len    = 128;
-		nhd_set_window(startx, endx, starty, endy);
-		nhd_write_data(NHD_COMMAND, 0x2c);
-
-		for (count = 0; count < len; count++) {
-			nhd_write_data(NHD_DATA,(unsigned char)((buffer[count+offset])>>16));	    //red
-			nhd_write_data(NHD_DATA,(unsigned char)((buffer[count+offset])>>8));		//green
-			nhd_write_data(NHD_DATA,(unsigned char)(buffer[count+offset]));			//blue
+	case SSD1963_ORDER_SCAN:
+		s = ssd1963_scan_row(item);
+		if (s > y && s < end) {
+			ssd1963_send_rect(item, x, s, width, end - s);
+			ssd1963_send_rect(item, x, y, width, s - y);
+			break;
+		}
+		ssd1963_send_rect(item, x, y, width, rows);
+		break;
+	default:
+		ssd1963_send_rect(item, x, y, width, rows);
+		break;
+	}
+}
+
+//Bring the bounding box into the shadow and send it as one window, or one
+//per piece if the row order splits it.
+static void ssd1963_send_bbox(struct ssd1963 *item, struct ssd1963_plan *plan,
+			      unsigned int order)
+{
+	unsigned int cpp = item->info->var.bits_per_pixel / 8;
+	unsigned int offset, y;
+
+	for (y = plan->y0; y < plan->y1; y++) {
+		offset = y * item->info->fix.line_length + plan->x0 * cpp;
+		memcpy(item->shadow + offset,
+		       ssd1963_overlay_row(item, y) + plan->x0 * cpp,
+		       (plan->x1 - plan->x0) * cpp);
+	}
+	ssd1963_send_ordered(item, plan->x0, plan->y0, plan->x1 - plan->x0,
+			     plan->y1 - plan->y0, order);
+}
+
+//On a rotated panel a framebuffer row is a panel column, so runs are only
+//sent as rectangles. A run joins the pending one while that resends fewer
+//unchanged pixels than opening another window would cost.
+static void ssd1963_grow_rect(struct ssd1963 *item, unsigned int y,
+			      unsigned int start, unsigned int end,
+			      struct ssd1963_batch *batch)
+{
+	unsigned int x0, x1, rows;
+	int waste;
+
+	if (batch->rows && y <= batch->y + batch->rows) {
+		x0 = min(batch->x, start);
+		x1 = max(batch->x + batch->width, end);
+		rows = y - batch->y + 1;
+		waste = (x1 - x0) * rows - batch->width * batch->rows -
+			(end - start);
+		if (waste <= (int)item->window_cost) {
+			batch->x = x0;
+			batch->width = x1 - x0;
+			batch->rows = rows;
+			return;
 		}
+	}
+	ssd1963_send_batch(item, batch);
+	batch->x = start;
+	batch->width = end - start;
+	batch->y = y;
+	batch->rows = 1;
+}
+
+//Take over the changed run [start, end) of row y, composed in row, into
+//the shadow and send it. Full rows are held back so adjacent ones share a
+//single window.
+static void ssd1963_send_run(struct ssd1963 *item, unsigned int y,
+			     const void *row, unsigned int start,
+			     unsigned int end, struct ssd1963_batch *batch)
+{
+	unsigned int cpp = item->info->var.bits_per_pixel / 8;
+	unsigned int offset = y * item->info->fix.line_length + start * cpp;
 
-		offset += len;
+	if (batch->plan) {
+		ssd1963_plan_run(item, batch->plan, y, start, end);
+		return;
+	}
 
-		startx = 0;
-		starty = y+1;
-		endx   = 319;
-		endy   = y+2;
-		len	   = 640;
-		nhd_set_window(startx, endx, starty, endy);
-		nhd_write_data(NHD_COMMAND, 0x2c);
+	memcpy(item->shadow + offset, row + start * cpp, (end - start) * cpp);
 
-		for (count = 0; count < len; count++) {
-			nhd_write_data(NHD_DATA,(unsigned char)((buffer[count+offset])>>16));	    //red
-			nhd_write_data(NHD_DATA,(unsigned char)((buffer[count+offset])>>8));		//green
-			nhd_write_data(NHD_DATA,(unsigned char)(buffer[count+offset]));			//blue
+	if (item->rot_soft) {
+		ssd1963_grow_rect(item, y, start, end, batch);
+		return;
+	}
+	if (start == 0 && end == item->info->var.xres) {
+		if (batch->rows && batch->y + batch->rows == y) {
+			batch->rows++;
+			return;
 		}
-		offset += len;
-
-		startx = 0;
-		starty = y+3;
-		endx   = 255;
-		endy   = y+3;
-		len	   = 256;
-		nhd_set_window(startx, endx, starty, endy);
-		nhd_write_data(NHD_COMMAND, 0x2c);
-
-		for (count = 0; count < len; count++) {
-			nhd_write_data(NHD_DATA,(unsigned char)((buffer[count+offset])>>16));	    //red
-			nhd_write_data(NHD_DATA,(unsigned char)((buffer[count+offset])>>8));		//green
-			nhd_write_data(NHD_DATA,(unsigned char)(buffer[count+offset]));			//blue
+		ssd1963_send_batch(item, batch);
+		batch->y = y;
+		batch->rows = 1;
+		return;
+	}
+	ssd1963_send_window(item, start, y, end - start, 1);
+}
+
+//Compare row y with the shadow a word at a time and send only the runs of
+//pixels that changed. Runs separated by fewer unchanged pixels than a window
+//costs are merged and sent together.
+static void ssd1963_flush_row(struct ssd1963 *item, unsigned int y,
+			      struct ssd1963_batch *batch)
+{
+	unsigned int xres = item->info->var.xres;
+	unsigned int cpp = item->info->var.bits_per_pixel / 8;
+	unsigned int offset = y * item->info->fix.line_length;
+	const u32 *fb = ssd1963_overlay_row(item, y);
+	const u32 *shadow = item->shadow + offset;
+	unsigned int words = DIV_ROUND_UP(xres * cpp, 4);
+	unsigned int gap = item->window_cost * cpp / 4;
+	unsigned int w, start = 0, end = 0;
+
+	if (!memcmp(fb, shadow, xres * cpp))
+		return;
+
+	for (w = 0; w < words; w++) {
+		if (!(fb[w] ^ shadow[w]))
+			continue;
+		if (end && w - end > gap) {
+			ssd1963_send_run(item, y, fb, start * 4 / cpp,
+					 end * 4 / cpp, batch);
+			end = 0;
 		}
+		if (!end)
+			start = w;
+		end = w + 1;
+	}
+	if (end)
+		ssd1963_send_run(item, y, fb, start * 4 / cpp,
+				 min(end * 4 / cpp, xres), batch);
+}
 
+//Diff every row the given pages touch, in the given order; rows shared by
+//two dirty pages are only looked at once.
+static void ssd1963_flush_pages(struct ssd1963 *item, unsigned long *pages,
+				unsigned int order, struct ssd1963_batch *batch)
+{
+	unsigned short *rows = item->flush_rows;
+	unsigned int xres = item->info->var.xres;
+	unsigned int i, y, last, next = 0, count = 0, pass, start;
+
+	for_each_set_bit(i, pages, item->pages_count) {
+		y = max_t(unsigned int, item->pages[i].y, next);
+		last = (item->pages[i].y * xres + item->pages[i].x +
+			item->pages[i].len - 1) / xres;
+		for (; y <= last; y++)
+			rows[count++] = y;
+		next = last + 1;
+	}
+
+	switch (order) {
+	case SSD1963_ORDER_INTERLEAVE:
+		for (pass = 0; pass < SSD1963_STRIPES; pass++)
+			for (i = 0; i < count; i++)
+				if (rows[i] / SSD1963_STRIPE_ROWS %
+				    SSD1963_STRIPES == pass)
+					ssd1963_flush_row(item, rows[i], batch);
+		break;
+	case SSD1963_ORDER_SCAN:
+		start = ssd1963_scan_row(item);
+		for (i = 0; i < count; i++)
+			if (rows[i] >= start)
+				ssd1963_flush_row(item, rows[i], batch);
+		for (i = 0; i < count && rows[i] < start; i++)
+			ssd1963_flush_row(item, rows[i], batch);
+		break;
+	default:
+		for (i = 0; i < count; i++)
+			ssd1963_flush_row(item, rows[i], batch);
 		break;
-	case 4:
-		offset = 0;
-		startx = x;
-		starty = y;
-		endx   = 319;
-		endy   = y;
-		len    = 64;
-		nhd_set_window(startx, endx, starty, endy);
-		nhd_write_data(NHD_COMMAND, 0x2c);
-
-		for (count = 0; count < len; count++) {
-			nhd_write_data(NHD_DATA,(unsigned char)((buffer[count+offset])>>16));	    //red
-			nhd_write_data(NHD_DATA,(unsigned char)((buffer[count+offset])>>8));		//green
-			nhd_write_data(NHD_DATA,(unsigned char)(buffer[count+offset]));			//blue
+	}
+}
+
+//Draw a console cell into the shadow, as sys_imageblit() drew it into the
+//framebuffer.
+static void ssd1963_glyph_to_shadow(struct ssd1963 *item,
+				    const struct ssd1963_glyph *glyph)
+{
+	unsigned int line_length = item->info->fix.line_length;
+	unsigned int cpp = item->info->var.bits_per_pixel / 8;
+	void *dst = item->shadow + glyph->y * line_length + glyph->x * cpp;
+	unsigned int r, b;
+	u32 pixel;
+
+	for (r = 0; r < glyph->rows; r++, dst += line_length) {
+		for (b = 0; b < 8; b++) {
+			pixel = glyph->bits[r] & (0x80 >> b) ?
+				glyph->fg : glyph->bg;
+			if (cpp == 4)
+				((u32 *)dst)[b] = pixel;
+			else if (cpp == 2)
+				((u16 *)dst)[b] = pixel;
+			else
+				((u8 *)dst)[b] = pixel;
 		}
-		offset += len;
-
-		startx = 0;
-		starty = y+1;
-		endx   = 319;
-		endy   = y+3;
-		len	   = 960;
-		nhd_set_window(startx, endx, starty, endy);
-		nhd_write_data(NHD_COMMAND, 0x2c);
-
-		for (count = 0; count < len; count++) {
-			nhd_write_data(NHD_DATA,(unsigned char)((buffer[count+offset])>>16));	    //red
-			nhd_write_data(NHD_DATA,(unsigned char)((buffer[count+offset])>>8));		//green
-			nhd_write_data(NHD_DATA,(unsigned char)(buffer[count+offset]));			//blue
+	}
+}
+
+//Panel format pixels of a cell that's already in the shadow, converted
+//from there the first time it's seen.
+static const u8 *ssd1963_glyph_pixels(struct ssd1963 *item,
+				      const struct ssd1963_glyph *glyph)
+{
+	unsigned int line_length = item->info->fix.line_length;
+	unsigned int cpp = item->info->var.bits_per_pixel / 8;
+	struct ssd1963_glyph_entry *entry;
+	const void *src;
+	u32 hash = glyph->fg * 31 + glyph->bg;
+	unsigned int r;
+
+	for (r = 0; r < glyph->rows; r++)
+		hash = hash * 31 + glyph->bits[r];
+	entry = &item->glyph_cache[hash_32(hash, SSD1963_GLYPH_ORDER)];
+	if (entry->rows == glyph->rows && entry->fg == glyph->fg &&
+	    entry->bg == glyph->bg &&
+	    !memcmp(entry->bits, glyph->bits, glyph->rows))
+		return entry->pixels;
+
+	entry->rows = glyph->rows;
+	entry->fg = glyph->fg;
+	entry->bg = glyph->bg;
+	memcpy(entry->bits, glyph->bits, glyph->rows);
+	src = item->shadow + glyph->y * line_length + glyph->x * cpp;
+	for (r = 0; r < glyph->rows; r++, src += line_length)
+		item->convert(item, entry->pixels + r * 8 * 3, src, 8);
+
+	return entry->pixels;
+}
+
+//Send the console cells queued since the last flush. Cells that follow
+//each other on a text line go out together as one window.
+static void ssd1963_flush_glyphs(struct ssd1963 *item)
+{
+	unsigned int xres = item->info->var.xres;
+	unsigned int yres = item->info->var.yres;
+	unsigned int stride = max(xres, yres) * 3;
+	unsigned int head, tail = item->glyph_tail;
+	const struct ssd1963_glyph *first, *glyph;
+	unsigned int cells, r;
+	const u8 *pixels;
+
+	if (!item->glyph_ring)
+		return;
+	head = READ_ONCE(item->glyph_head);
+	//Read the cells only after the head that publishes them.
+	smp_rmb();
+
+	while (tail != head) {
+		first = &item->glyph_ring[tail % SSD1963_GLYPH_RING];
+		//Queued before a mode change that left it off screen.
+		if (first->x + 8 > xres || first->y + first->rows > yres) {
+			tail++;
+			continue;
 		}
 
-		break;
+		for (cells = 0; tail != head; tail++, cells++) {
+			glyph = &item->glyph_ring[tail % SSD1963_GLYPH_RING];
+			if (glyph->y != first->y ||
+			    glyph->rows != first->rows ||
+			    glyph->x != first->x + cells * 8 ||
+			    glyph->x + 8 > xres)
+				break;
+			ssd1963_glyph_to_shadow(item, glyph);
+			pixels = ssd1963_glyph_pixels(item, glyph);
+			for (r = 0; r < glyph->rows; r++)
+				memcpy(item->glyph_line + r * stride + cells * 8 * 3,
+				       pixels + r * 8 * 3, 8 * 3);
+		}
 
+		nhd_set_window(item, first->x, first->x + cells * 8 - 1,
+			       first->y, first->y + first->rows - 1);
+		nhd_write_data(item, NHD_COMMAND, 0x2c);
+		for (r = 0; r < first->rows; r++)
+			nhd_write_pixels(item, item->glyph_line + r * stride,
+					 cells * 8 * 3);
+
+		//Text under an overlay has just covered it; have the diff
+		//put it back on top.
+		if (ssd1963_overlay_hit(item, first->x, first->y, cells * 8,
+					first->rows))
+			for (r = item->row_first_page[first->y];
+			     r <= item->row_last_page[first->y + first->rows - 1];
+			     r++)
+				set_bit(r, item->flush_pages);
 	}
+
+	//Done reading the cells before imageblit may reuse them.
+	smp_mb();
+	WRITE_ONCE(item->glyph_tail, tail);
 }
 
-static void ssd1963_update_all(struct ssd1963 *item)
+//After a palette change the panel shows the old colors wherever they're
+//used, which the shadow can't tell, so send the whole frame. Converted
+//glyphs are stale as well.
+static void ssd1963_flush_palette(struct ssd1963 *item)
 {
-	unsigned short i;
-	struct fb_deferred_io *fbdefio = item->info->fbdefio;
-	for (i = 0; i < item->pages_count; i++) {
-		item->pages[i].must_update=1;
+	struct ssd1963_plan all = {
+		.x1 = item->info->var.xres,
+		.y1 = item->info->var.yres,
+	};
+
+	if (!atomic_xchg(&item->palette_changed, 0))
+		return;
+	//See the colors set before the flag.
+	smp_rmb();
+
+	if (item->glyph_cache)
+		memset(item->glyph_cache, 0, (1 << SSD1963_GLYPH_ORDER) *
+		       sizeof(struct ssd1963_glyph_entry));
+	ssd1963_send_bbox(item, &all, ssd1963_flush_order(item));
+}
+
+//Send the damage on the given pages. Comparing is cheap next to the bus,
+//so look at it once to plan and again to send it run by run if that wins.
+static void ssd1963_flush_set(struct ssd1963 *item, unsigned long *pages)
+{
+	struct ssd1963_plan plan = { .next_full = UINT_MAX };
+	struct ssd1963_batch batch = { .plan = &plan };
+	unsigned int order = ssd1963_flush_order(item);
+
+	ssd1963_flush_pages(item, pages, SSD1963_ORDER_LINEAR, &batch);
+	batch.plan = NULL;
+	if (ssd1963_plan_bbox(item, &plan)) {
+		ssd1963_send_bbox(item, &plan, order);
+	} else if (plan.pixels) {
+		ssd1963_flush_pages(item, pages, order, &batch);
+		ssd1963_send_batch(item, &batch);
 	}
-	schedule_delayed_work(&item->info->deferred_work, fbdefio->delay);
+}
+
+//Runs on the panel's flush thread.
+static void ssd1963_flush(struct kthread_work *work)
+{
+	struct ssd1963 *item = container_of(work, struct ssd1963, flush_work);
+	unsigned int i;
+
+	//Over the rate limit the flush is put off instead; what's drawn in
+	//the meantime goes out with it, only in its latest state. Once the
+	//thread is being stopped the timer must stay disarmed.
+	if (item->max_fps && time_before(jiffies, item->next_flush)) {
+		if (!item->flush_stopping)
+			mod_timer(&item->flush_timer, item->next_flush);
+		return;
+	}
+	if (item->max_fps)
+		item->next_flush = jiffies + DIV_ROUND_UP(HZ, item->max_fps);
+
+	item->flush_started++;
+	atomic_set(&item->pending, 0);
+
+	//Take the damage collected so far with one atomic swap per word.
+	//Pages marked after their word was swapped out stay in dirty and
+	//rearm the flush, so nothing is lost while we're busy copying.
+	//Split off what falls into the priority regions; the two halves
+	//come from one word, so a concurrent SSD1963IO_SET_PRIORITY can
+	//only change the order pages go out in.
+	for (i = 0; i < BITS_TO_LONGS(item->pages_count); i++) {
+		item->flush_pages[i] = xchg(&item->dirty[i], 0);
+		item->flush_urgent[i] = item->flush_pages[i] &
+				      item->prio_pages[i];
+		item->flush_pages[i] &= ~item->flush_urgent[i];
+	}
+
+	ssd1963_overlay_snapshot(item);
+	ssd1963_flush_palette(item);
+	//Console cells go out after the swap: anything drawn over them
+	//since has either marked a page taken above, which the diff below
+	//then sends over them, or waits for the next flush with its cells.
+	ssd1963_flush_glyphs(item);
+	ssd1963_flush_set(item, item->flush_urgent);
+	ssd1963_flush_set(item, item->flush_pages);
+
+	spin_lock(&item->flush_lock);
+	item->flush_done_ns = ktime_to_ns(ktime_get());
+	item->flush_seq++;
+	spin_unlock(&item->flush_lock);
+	wake_up_all(&item->flush_wq);
 }
 
 static void ssd1963_update(struct fb_info *info, struct list_head *pagelist)
 {
 	struct ssd1963 *item = (struct ssd1963 *)info->par;
 	struct page *page;
-	int i;
+	int superseded = 0;
 
 	//We can be called because of pagefaults (mmap'ed framebuffer, pages
 	//returned in *pagelist) or because of kernel activity
-	//(pages[i]/must_update!=0). Add the former to the list of the latter.
+	//(dirty bitmap). Add the former to the latter and leave the bus
+	//transfer to the flush thread.
 	list_for_each_entry(page, pagelist, lru) {
-		item->pages[page->index].must_update=1;
+		superseded |= ssd1963_mark_page(item, page->index);
 	}
+	ssd1963_count_frame(item, superseded);
 
-	//Copy changed pages.
-	for (i=0; i<item->pages_count; i++) {
-		//ToDo: Small race here between checking and setting must_update,
-		//maybe lock?
-		if (item->pages[i].must_update) {
-			item->pages[i].must_update=0;
-			ssd1963_copy(item, i);
-		}
+	queue_kthread_work(&item->flush_worker, &item->flush_work);
+}
+
+static int ssd1963_set_flush_prio(struct ssd1963 *item, int prio)
+{
+	struct sched_param param = { .sched_priority = prio };
+	int ret;
+
+	if (prio < 0 || prio >= MAX_RT_PRIO)
+		return -EINVAL;
+
+	ret = sched_setscheduler(item->flush_thread,
+				 prio ? SCHED_FIFO : SCHED_NORMAL, &param);
+	if (ret) {
+		dev_err(item->dev, "%s: unable to set priority %d\n",
+			__func__, prio);
+		return ret;
 	}
+	item->flush_prio = prio;
 
+	return 0;
+}
+
+static int ssd1963_flush_start(struct ssd1963 *item)
+{
+	init_kthread_worker(&item->flush_worker);
+	init_kthread_work(&item->flush_work, ssd1963_flush);
+	setup_timer(&item->flush_timer, ssd1963_flush_timer,
+		    (unsigned long)item);
+
+	item->flush_thread = kthread_create(kthread_worker_fn,
+					    &item->flush_worker,
+					    "%s", dev_name(item->dev));
+	if (IS_ERR(item->flush_thread)) {
+		dev_err(item->dev, "%s: unable to create flush thread\n",
+			__func__);
+		return PTR_ERR(item->flush_thread);
+	}
+
+	if (flush_cpu >= 0) {
+		if (flush_cpu < nr_cpu_ids && cpu_online(flush_cpu))
+			kthread_bind(item->flush_thread, flush_cpu);
+		else
+			dev_warn(item->dev, "%s: cpu %d is not online\n",
+				 __func__, flush_cpu);
+	}
+	ssd1963_set_flush_prio(item, flush_prio);
+	wake_up_process(item->flush_thread);
+
+	return 0;
+}
+
+static void ssd1963_flush_stop(struct ssd1963 *item)
+{
+	//A flush that checked flush_stopping just before it was set can
+	//still arm the timer; the second del_timer_sync() catches that.
+	item->flush_stopping = 1;
+	smp_mb();
+	del_timer_sync(&item->flush_timer);
+	flush_kthread_worker(&item->flush_worker);
+	del_timer_sync(&item->flush_timer);
+	kthread_stop(item->flush_thread);
+}
+
+static ssize_t ssd1963_flush_prio_show(struct device *dev,
+				       struct device_attribute *attr, char *buf)
+{
+	struct ssd1963 *item = dev_get_drvdata(dev);
+
+	return sprintf(buf, "%d\n", item->flush_prio);
+}
+
+static ssize_t ssd1963_flush_prio_store(struct device *dev,
+					struct device_attribute *attr,
+					const char *buf, size_t count)
+{
+	struct ssd1963 *item = dev_get_drvdata(dev);
+	unsigned long prio;
+	int ret;
+
+	ret = strict_strtoul(buf, 10, &prio);
+	if (ret)
+		return ret;
+	ret = ssd1963_set_flush_prio(item, prio);
+
+	return ret ? ret : count;
 }
 
-static void __init ssd1963_setup(struct ssd1963 *item)
+static DEVICE_ATTR(flush_prio, 0644, ssd1963_flush_prio_show,
+		   ssd1963_flush_prio_store);
+
+static ssize_t ssd1963_max_fps_show(struct device *dev,
+				    struct device_attribute *attr, char *buf)
 {
+	struct ssd1963 *item = dev_get_drvdata(dev);
+
+	return sprintf(buf, "%u\n", item->max_fps);
+}
+
+static ssize_t ssd1963_max_fps_store(struct device *dev,
+				     struct device_attribute *attr,
+				     const char *buf, size_t count)
+{
+	struct ssd1963 *item = dev_get_drvdata(dev);
+	unsigned long fps;
+	int ret;
+
+	ret = strict_strtoul(buf, 10, &fps);
+	if (ret)
+		return ret;
+	if (fps > HZ)
+		return -EINVAL;
+	item->max_fps = fps;
+
+	return count;
+}
+
+static DEVICE_ATTR(max_fps, 0644, ssd1963_max_fps_show,
+		   ssd1963_max_fps_store);
+
+static ssize_t ssd1963_flush_order_show(struct device *dev,
+					struct device_attribute *attr,
+					char *buf)
+{
+	struct ssd1963 *item = dev_get_drvdata(dev);
+
+	return sprintf(buf, "%u\n", item->flush_order);
+}
+
+static ssize_t ssd1963_flush_order_store(struct device *dev,
+					 struct device_attribute *attr,
+					 const char *buf, size_t count)
+{
+	struct ssd1963 *item = dev_get_drvdata(dev);
+	unsigned long order;
+	int ret;
+
+	ret = strict_strtoul(buf, 10, &order);
+	if (ret)
+		return ret;
+	if (order >= SSD1963_ORDERS)
+		return -EINVAL;
+	item->flush_order = order;
+
+	return count;
+}
+
+static DEVICE_ATTR(flush_order, 0644, ssd1963_flush_order_show,
+		   ssd1963_flush_order_store);
+
+//Updates handed in, flushes done, updates that joined a pending flush and
+//updates that overwrote damage before it was sent.
+static ssize_t ssd1963_flush_stats_show(struct device *dev,
+					struct device_attribute *attr,
+					char *buf)
+{
+	struct ssd1963 *item = dev_get_drvdata(dev);
+
+	return sprintf(buf, "%u %u %u %u\n", atomic_read(&item->frames),
+		       item->flush_seq, atomic_read(&item->coalesced),
+		       atomic_read(&item->dropped));
+}
+
+static DEVICE_ATTR(flush_stats, 0444, ssd1963_flush_stats_show, NULL);
+
+//Pixel data interface (0xf0) for the wired bus width.
+static u8 ssd1963_interface(struct ssd1963 *item)
+{
+	switch (item->bus_width) {
+	case 9:
+		return 0x06;
+	case 12:
+		return 0x01;
+	case 16:
+		return 0x03;
+	default:
+		return 0x00;
+	}
+}
+
+static void ssd1963_setup(struct ssd1963 *item)
+{
+	const struct ssd1963_panel *panel = &item->panel;
+	unsigned int ht = panel->xres + panel->hsync_len +
+			  panel->hback_porch + panel->hfront_porch;
+	unsigned int hps = panel->hsync_len + panel->hback_porch;
+	unsigned int vt = panel->yres + panel->vsync_len +
+			  panel->vback_porch + panel->vfront_porch;
+	unsigned int vps = panel->vsync_len + panel->vback_porch;
+	//LSHIFT = PLL * (fpr + 1) / 2^20
+	u32 fpr = div_u64(((u64)panel->pclk_khz << 20) + SSD1963_PLL_KHZ / 2,
+			  SSD1963_PLL_KHZ) - 1;
+
 	dev_dbg(item->dev, "%s: item=0x%p\n", __func__, (void *)item);
 
-	nhd_init_gpio_regs();
+	nhd_init_gpio_regs(item);
 
-	at91_set_gpio_output(AT91_PIN_PE27, 0); //RESET
+	at91_set_gpio_output(item->pins.reset_pin, 0); //RESET
 	udelay(5);							//TODO if not works try using ms instead of us;
-	at91_set_gpio_output(AT91_PIN_PE27, 1); //RESET
+	at91_set_gpio_output(item->pins.reset_pin, 1); //RESET
 	udelay(100);							//TODO if not works try using ms instead of us;
 
-	nhd_write_data(NHD_COMMAND, 0x01); 		//Software Reset
-	nhd_write_data(NHD_COMMAND, 0x01);
-	nhd_write_data(NHD_COMMAND, 0x01);
+	nhd_write_data(item, NHD_COMMAND, 0x01); 		//Software Reset
+	nhd_write_data(item, NHD_COMMAND, 0x01);
+	nhd_write_data(item, NHD_COMMAND, 0x01);
 	udelay(10);
-	nhd_write_to_register(0xe0, 0x01);    		//START PLL
+	nhd_write_to_register(item, 0xe0, 0x01);    		//START PLL
 	udelay(100);
-	nhd_write_to_register(0xe0, 0x03);    		//LOCK PLL
-	nhd_write_data(NHD_COMMAND, 0xb0);		//SET LCD MODE  SET TFT 18Bits MODE
-	nhd_write_data(NHD_DATA, 0x0c);			//SET TFT MODE 24 bits & hsync+Vsync+DEN MODE
-	nhd_write_data(NHD_DATA, 0x80);			//SET TFT MODE & hsync+Vsync+DEN MODE           !!!!
-	nhd_write_data(NHD_DATA, 0x01);			//SET horizontal size=320-1 HightByte
-	nhd_write_data(NHD_DATA, 0x3f);		    //SET horizontal size=320-1 LowByte
-	nhd_write_data(NHD_DATA, 0x00);			//SET vertical size=240-1 HightByte
-	nhd_write_data(NHD_DATA, 0xef);			//SET vertical size=240-1 LowByte
-	nhd_write_data(NHD_DATA, 0x00);			//SET even/odd line RGB seq.=RGB
-	nhd_write_to_register(0xf0,0x00);	        //SET pixel data I/F format=8bit
-	nhd_write_to_register(0x3a,0x70);           //SET R G B format = 8 8 8
-	nhd_write_data(NHD_COMMAND, 0xe6);   	//SET PCLK freq=6.4MHz  ; pixel clock frequency
-	nhd_write_data(NHD_DATA, 0x00);
-	nhd_write_data(NHD_DATA, 0xe7);
-	nhd_write_data(NHD_DATA, 0x4f);
-	nhd_write_data(NHD_COMMAND, 0xb4);		//SET HBP,
-	nhd_write_data(NHD_DATA, 0x01);			//SET HSYNC Total 440
-	nhd_write_data(NHD_DATA, 0xb8);
-	nhd_write_data(NHD_DATA, 0x00);			//SET HBP 68
-	nhd_write_data(NHD_DATA, 0x44);
-	nhd_write_data(NHD_DATA, 0x0f);			//SET VBP 16=15+1
-	nhd_write_data(NHD_DATA, 0x00);			//SET Hsync pulse start position
-	nhd_write_data(NHD_DATA, 0x00);
-	nhd_write_data(NHD_DATA, 0x00);			//SET Hsync pulse subpixel start position
-	nhd_write_data(NHD_COMMAND, 0xb6); 		//SET VBP,
-	nhd_write_data(NHD_DATA, 0x01);			//SET Vsync total 265=264+1
-	nhd_write_data(NHD_DATA, 0x08);
-	nhd_write_data(NHD_DATA, 0x00);			//SET VBP=19
-	nhd_write_data(NHD_DATA, 0x13);
-	nhd_write_data(NHD_DATA, 0x07);			//SET Vsync pulse 8=7+1
-	nhd_write_data(NHD_DATA, 0x00);			//SET Vsync pulse start position
-	nhd_write_data(NHD_DATA, 0x00);
-	nhd_write_data(NHD_COMMAND, 0x2a);		//SET column address
-	nhd_write_data(NHD_DATA, 0x00);			//SET start column address=0
-	nhd_write_data(NHD_DATA, 0x00);
-	nhd_write_data(NHD_DATA, 0x01);			//SET end column address=319
-	nhd_write_data(NHD_DATA, 0x3f);
-	nhd_write_data(NHD_COMMAND, 0x2b);		//SET page address
-	nhd_write_data(NHD_DATA, 0x00);			//SET start page address=0
-	nhd_write_data(NHD_DATA, 0x00);
-	nhd_write_data(NHD_DATA, 0x00);			//SET end page address=239
-	nhd_write_data(NHD_DATA, 0xef);
-	nhd_write_data(NHD_COMMAND, 0x29);		//SET display on
-
-	nhd_set_window(0x0000, 0x013f, 0x0000, 0x00ef);
-	nhd_write_data(NHD_COMMAND, 0x2c);
-
-	nhd_clear_graph();
-
-	printk(KERN_ALERT "COLOR LCD driver initialized\n");
+	nhd_write_to_register(item, 0xe0, 0x03);    		//LOCK PLL
+	nhd_write_data(item, NHD_COMMAND, 0xb0);		//SET LCD MODE
+	nhd_write_data(item, NHD_DATA, panel->lcd_mode);	//SET panel width, dithering, polarities
+	nhd_write_data(item, NHD_DATA, 0x80);			//SET TFT MODE & hsync+Vsync+DEN MODE           !!!!
+	nhd_write_data(item, NHD_DATA, (panel->xres - 1) >> 8);	//SET horizontal size HightByte
+	nhd_write_data(item, NHD_DATA, panel->xres - 1);	//SET horizontal size LowByte
+	nhd_write_data(item, NHD_DATA, (panel->yres - 1) >> 8);	//SET vertical size HightByte
+	nhd_write_data(item, NHD_DATA, panel->yres - 1);	//SET vertical size LowByte
+	nhd_write_data(item, NHD_DATA, 0x00);			//SET even/odd line RGB seq.=RGB
+	nhd_write_to_register(item, 0xf0, ssd1963_interface(item)); //SET pixel data I/F format
+	nhd_write_to_register(item, 0x3a,0x70);           //SET R G B format = 8 8 8
+	nhd_write_data(item, NHD_COMMAND, 0xe6);   	//SET PCLK freq ; pixel clock frequency
+	nhd_write_data(item, NHD_DATA, fpr >> 16);
+	nhd_write_data(item, NHD_DATA, fpr >> 8);
+	nhd_write_data(item, NHD_DATA, fpr);
+	nhd_write_data(item, NHD_COMMAND, 0xb4);		//SET HBP,
+	nhd_write_data(item, NHD_DATA, (ht - 1) >> 8);		//SET HSYNC Total
+	nhd_write_data(item, NHD_DATA, ht - 1);
+	nhd_write_data(item, NHD_DATA, hps >> 8);		//SET HBP
+	nhd_write_data(item, NHD_DATA, hps);
+	nhd_write_data(item, NHD_DATA, panel->hsync_len - 1);	//SET Hsync pulse width
+	nhd_write_data(item, NHD_DATA, 0x00);			//SET Hsync pulse start position
+	nhd_write_data(item, NHD_DATA, 0x00);
+	nhd_write_data(item, NHD_DATA, 0x00);			//SET Hsync pulse subpixel start position
+	nhd_write_data(item, NHD_COMMAND, 0xb6); 		//SET VBP,
+	nhd_write_data(item, NHD_DATA, (vt - 1) >> 8);		//SET Vsync total
+	nhd_write_data(item, NHD_DATA, vt - 1);
+	nhd_write_data(item, NHD_DATA, vps >> 8);		//SET VBP
+	nhd_write_data(item, NHD_DATA, vps);
+	nhd_write_data(item, NHD_DATA, panel->vsync_len - 1);	//SET Vsync pulse width
+	nhd_write_data(item, NHD_DATA, 0x00);			//SET Vsync pulse start position
+	nhd_write_data(item, NHD_DATA, 0x00);
+	//SET address mode, flip horizontal+vertical for 180 degrees
+	nhd_write_to_register(item, 0x36,
+			      item->rotate == 180 && !item->rot_soft ? 0x03 : 0x00);
+	nhd_set_window(item, 0, panel->xres - 1, 0, panel->yres - 1);
+	nhd_write_data(item, NHD_COMMAND, 0x29);		//SET display on
+
+	nhd_clear_graph(item);
+
+	dev_info(item->dev, "COLOR LCD driver initialized\n");
 }
 
 //This routine will allocate the buffer for the complete framebuffer. This
 //is one continuous chunk of 16-bit pixel values; userspace programs
 //will write here.
-static int __init ssd1963_video_alloc(struct ssd1963 *item)
+static int ssd1963_video_alloc(struct ssd1963 *item)
 {
 	unsigned int frame_size;
 
@@ -510,14 +1735,77 @@ static int __init ssd1963_video_alloc(struct ssd1963 *item)
 		__func__, (void *)item, item->pages_count);
 
 	item->info->fix.smem_len = item->pages_count * PAGE_SIZE;
+	//vmalloc_user() so untracked mappings can remap it, see ssd1963_mmap().
 	item->info->fix.smem_start =
-	    (unsigned long)vmalloc(item->info->fix.smem_len);
+	    (unsigned long)vmalloc_user(item->info->fix.smem_len);
 	if (!item->info->fix.smem_start) {
 		dev_err(item->dev, "%s: unable to vmalloc\n", __func__);
 		return -ENOMEM;
 	}
 	memset((void *)item->info->fix.smem_start, 0, item->info->fix.smem_len);
 
+	//Both start out black: ssd1963_setup() clears the panel.
+	item->shadow = vmalloc(item->info->fix.smem_len);
+	if (!item->shadow) {
+		dev_err(item->dev, "%s: unable to vmalloc shadow\n", __func__);
+		vfree((void *)item->info->fix.smem_start);
+		return -ENOMEM;
+	}
+	memset(item->shadow, 0, item->info->fix.smem_len);
+
+	//Sized for the longest row in any orientation, so it can be reused
+	//as is when the mode changes.
+	item->txbuf = kmalloc(max(item->info->var.xres, item->info->var.yres) * 3,
+			      GFP_KERNEL);
+	if (!item->txbuf) {
+		dev_err(item->dev, "%s: unable to kmalloc txbuf\n", __func__);
+		vfree(item->shadow);
+		vfree((void *)item->info->fix.smem_start);
+		return -ENOMEM;
+	}
+
+	if (item->rot_soft) {
+		item->rotbuf = kmalloc(max(item->info->var.xres,
+					   item->info->var.yres) *
+				       (item->info->var.bits_per_pixel / 8) *
+				       SSD1963_ROT_ROWS, GFP_KERNEL);
+		if (!item->rotbuf) {
+			dev_err(item->dev, "%s: unable to kmalloc rotbuf\n",
+				__func__);
+			kfree(item->txbuf);
+			vfree(item->shadow);
+			vfree((void *)item->info->fix.smem_start);
+			return -ENOMEM;
+		}
+	}
+
+	//Cells are sent as they are in the framebuffer, which only works
+	//while the panel takes framebuffer rows.
+	if (glyph_cache && !item->rot_soft) {
+		item->glyph_ring = vmalloc(SSD1963_GLYPH_RING *
+					   sizeof(struct ssd1963_glyph));
+		item->glyph_cache = vmalloc((1 << SSD1963_GLYPH_ORDER) *
+					    sizeof(struct ssd1963_glyph_entry));
+		item->glyph_line = vmalloc(max(item->info->var.xres,
+					       item->info->var.yres) * 3 *
+					   SSD1963_GLYPH_ROWS);
+		if (!item->glyph_ring || !item->glyph_cache ||
+		    !item->glyph_line) {
+			dev_err(item->dev, "%s: unable to vmalloc glyph cache\n",
+				__func__);
+			vfree(item->glyph_line);
+			vfree(item->glyph_cache);
+			vfree(item->glyph_ring);
+			kfree(item->rotbuf);
+			kfree(item->txbuf);
+			vfree(item->shadow);
+			vfree((void *)item->info->fix.smem_start);
+			return -ENOMEM;
+		}
+		memset(item->glyph_cache, 0, (1 << SSD1963_GLYPH_ORDER) *
+		       sizeof(struct ssd1963_glyph_entry));
+	}
+
 	return 0;
 }
 
@@ -525,13 +1813,19 @@ static void ssd1963_video_free(struct ssd1963 *item)
 {
 	dev_dbg(item->dev, "%s: item=0x%p\n", __func__, (void *)item);
 
-	kfree((void *)item->info->fix.smem_start);
+	vfree(item->glyph_line);
+	vfree(item->glyph_cache);
+	vfree(item->glyph_ring);
+	kfree(item->rotbuf);
+	kfree(item->txbuf);
+	vfree(item->shadow);
+	vfree((void *)item->info->fix.smem_start);
 }
 
 //This routine will allocate a ssd1963_page struct for each vm page in the
 //main framebuffer memory. Each struct will contain a pointer to the page
 //start, an x- and y-offset, and the length of the pagebuffer which is in the framebuffer.
-static int __init ssd1963_pages_alloc(struct ssd1963 *item)
+static int ssd1963_pages_alloc(struct ssd1963 *item)
 {
 	unsigned short pixels_per_page;
 	unsigned short yoffset_per_page;
@@ -541,6 +1835,7 @@ static int __init ssd1963_pages_alloc(struct ssd1963 *item)
 	unsigned short y = 0;
 	unsigned long *buffer;
 	unsigned int len;
+	unsigned int row;
 
 	dev_dbg(item->dev, "%s: item=0x%p\n", __func__, (void *)item);
 
@@ -552,6 +1847,43 @@ static int __init ssd1963_pages_alloc(struct ssd1963 *item)
 		return -ENOMEM;
 	}
 
+	item->dirty = kcalloc(BITS_TO_LONGS(item->pages_count),
+			      sizeof(unsigned long), GFP_KERNEL);
+	item->row_first_page = kcalloc(item->info->var.yres,
+	                              sizeof(unsigned short), GFP_KERNEL);
+	item->row_last_page = kcalloc(item->info->var.yres,
+	                             sizeof(unsigned short), GFP_KERNEL);
+	item->flush_pages = kcalloc(BITS_TO_LONGS(item->pages_count),
+				    sizeof(unsigned long), GFP_KERNEL);
+	item->prio_pages = kcalloc(BITS_TO_LONGS(item->pages_count),
+				   sizeof(unsigned long), GFP_KERNEL);
+	item->flush_urgent = kcalloc(BITS_TO_LONGS(item->pages_count),
+				   sizeof(unsigned long), GFP_KERNEL);
+	item->flush_rows = kcalloc(item->info->var.yres,
+				   sizeof(unsigned short), GFP_KERNEL);
+	item->overlay_row = kmalloc(item->info->fix.line_length, GFP_KERNEL);
+	//Two images per sprite, set and flushed, of up to 32 bits per pixel.
+	item->sprite_pixels = vmalloc(2 * SSD1963_SPRITES * 4 *
+				      SSD1963_SPRITE_MAX * SSD1963_SPRITE_MAX);
+	if (!item->dirty || !item->flush_pages ||
+	    !item->prio_pages || !item->flush_urgent || !item->flush_rows ||
+	    !item->overlay_row || !item->sprite_pixels ||
+	    !item->row_first_page || !item->row_last_page) {
+		dev_err(item->dev, "%s: unable to kcalloc for dirty bitmap\n",
+			__func__);
+		vfree(item->sprite_pixels);
+		kfree(item->overlay_row);
+		kfree(item->dirty);
+		kfree(item->flush_pages);
+		kfree(item->prio_pages);
+		kfree(item->flush_urgent);
+		kfree(item->flush_rows);
+		kfree(item->row_first_page);
+		kfree(item->row_last_page);
+		kfree(item->pages);
+		return -ENOMEM;
+	}
+
 	pixels_per_page = PAGE_SIZE / (item->info->var.bits_per_pixel / 8);
 	yoffset_per_page = pixels_per_page / item->info->var.xres;
 	xoffset_per_page = pixels_per_page -
@@ -585,6 +1917,23 @@ static int __init ssd1963_pages_alloc(struct ssd1963 *item)
 		buffer += pixels_per_page;
 	}
 
+	for (index = 0; index < SSD1963_SPRITES; index++) {
+		item->sprites[index].pixels = item->sprite_pixels +
+			index * 4 * SSD1963_SPRITE_MAX * SSD1963_SPRITE_MAX;
+		item->flush_sprites[index].pixels = item->sprite_pixels +
+			(SSD1963_SPRITES + index) * 4 *
+			SSD1963_SPRITE_MAX * SSD1963_SPRITE_MAX;
+	}
+
+	//Rows map to pages through their linear pixel offset. Precompute it so
+	//marking damage doesn't have to search the page list.
+	for (row = 0; row < item->info->var.yres; row++) {
+		item->row_first_page[row] =
+		    (row * item->info->var.xres) / pixels_per_page;
+		item->row_last_page[row] =
+		    ((row + 1) * item->info->var.xres - 1) / pixels_per_page;
+	}
+
 	return 0;
 }
 
@@ -592,6 +1941,15 @@ static void ssd1963_pages_free(struct ssd1963 *item)
 {
 	dev_dbg(item->dev, "%s: item=0x%p\n", __func__, (void *)item);
 
+	kfree(item->row_last_page);
+	kfree(item->row_first_page);
+	vfree(item->sprite_pixels);
+	kfree(item->overlay_row);
+	kfree(item->flush_rows);
+	kfree(item->flush_urgent);
+	kfree(item->prio_pages);
+	kfree(item->flush_pages);
+	kfree(item->dirty);
 	kfree(item->pages);
 }
 
@@ -634,8 +1992,21 @@ static int ssd1963_setcolreg(unsigned regno,
 			ret = 0;
 		}
 		break;
-	case FB_VISUAL_STATIC_PSEUDOCOLOR:
 	case FB_VISUAL_PSEUDOCOLOR:
+		if (regno < 256) {
+			struct ssd1963 *item = (struct ssd1963 *)info->par;
+
+			item->palette[regno] = ((red >> 8) << 16) |
+					       ((green >> 8) << 8) |
+					       (blue >> 8);
+			//Every pixel of that color is now shown wrong.
+			smp_wmb();
+			atomic_set(&item->palette_changed, 1);
+			ssd1963_schedule_flush(item);
+			ret = 0;
+		}
+		break;
+	case FB_VISUAL_STATIC_PSEUDOCOLOR:
 		break;
 	}
 	return ret;
@@ -646,22 +2017,50 @@ static int ssd1963_blank(int blank_mode, struct fb_info *info)
 	return 0;
 }
 
+//Touch the pages rows [y, y + h) hit, so the flush thread will update them.
+static int ssd1963_mark_rows(struct ssd1963 *item, unsigned int y,
+			     unsigned int h)
+{
+	unsigned int i, last = item->row_last_page[y + h - 1];
+	int superseded = 0;
+
+	//The pixels must be visible before the flush thread can see the
+	//page as dirty.
+	smp_wmb();
+	for (i = item->row_first_page[y]; i <= last; i++)
+		superseded |= ssd1963_mark_page(item, i);
+	return superseded;
+}
+
+//How long damage to rows [y, y + h) may wait for the flush.
+static unsigned long ssd1963_rows_delay(struct ssd1963 *item, unsigned int y,
+					unsigned int h)
+{
+	unsigned int i, last = item->row_last_page[y + h - 1];
+
+	if (item->prio_delay)
+		for (i = item->row_first_page[y]; i <= last; i++)
+			if (test_bit(i, item->prio_pages))
+				return item->prio_delay;
+	return item->defio.delay;
+}
+
 static void ssd1963_touch(struct fb_info *info, int x, int y, int w, int h)
 {
 	struct fb_deferred_io *fbdefio = info->fbdefio;
 	struct ssd1963 *item = (struct ssd1963 *)info->par;
-	int i, ystart, yend;
-	if (fbdefio) {
-		//Touch the pages the y-range hits, so the deferred io will update them.
-		for (i=0; i<item->pages_count; i++) {
-			ystart=item->pages[i].y;
-			yend=item->pages[i].y+(item->pages[i].len/info->fix.line_length)+1;
-			if (!((y+h)<ystart || y>yend)) {
-				item->pages[i].must_update=1;
-			}
-		}
-		//Schedule the deferred IO to kick in after a delay.
-		schedule_delayed_work(&info->deferred_work, fbdefio->delay);
+
+	if (y < 0) {
+		h += y;
+		y = 0;
+	}
+	if (y + h > (int)info->var.yres)
+		h = info->var.yres - y;
+	if (fbdefio && h > 0) {
+		ssd1963_count_frame(item, ssd1963_mark_rows(item, y, h));
+		//Schedule the flush thread to kick in after a delay.
+		ssd1963_schedule_flush_in(item,
+					  ssd1963_rows_delay(item, y, h));
 	}
 }
 
@@ -671,9 +2070,65 @@ static void ssd1963_fillrect(struct fb_info *p, const struct fb_fillrect *rect)
 	ssd1963_touch(p, rect->dx, rect->dy, rect->width, rect->height);
 }
 
+//Queue console text for the flush thread, one cell per 8 pixel column.
+//Anything else, and text that doesn't fit into the ring, goes through the
+//pages instead.
+static bool ssd1963_queue_glyphs(struct ssd1963 *item,
+				 const struct fb_image *image)
+{
+	struct fb_info *info = item->info;
+	const u32 *pal = info->pseudo_palette;
+	unsigned int cells = image->width / 8;
+	unsigned int head = item->glyph_head;
+	struct ssd1963_glyph *glyph;
+	unsigned int c, r;
+
+	if (!item->glyph_ring || image->depth != 1 ||
+	    !cells || image->width % 8 ||
+	    !image->height || image->height > SSD1963_GLYPH_ROWS ||
+	    (info->fix.visual == FB_VISUAL_TRUECOLOR &&
+	     (image->fg_color >= 16 || image->bg_color >= 16)) ||
+	    image->dx + image->width > info->var.xres ||
+	    image->dy + image->height > info->var.yres)
+		return false;
+	if (head - READ_ONCE(item->glyph_tail) + cells > SSD1963_GLYPH_RING)
+		return false;
+
+	for (c = 0; c < cells; c++, head++) {
+		glyph = &item->glyph_ring[head % SSD1963_GLYPH_RING];
+		glyph->x = image->dx + c * 8;
+		glyph->y = image->dy;
+		glyph->rows = image->height;
+		//Paletted framebuffers take the color index as it is.
+		if (info->fix.visual == FB_VISUAL_TRUECOLOR) {
+			glyph->fg = pal[image->fg_color];
+			glyph->bg = pal[image->bg_color];
+		} else {
+			glyph->fg = image->fg_color;
+			glyph->bg = image->bg_color;
+		}
+		for (r = 0; r < image->height; r++)
+			glyph->bits[r] = image->data[r * cells + c];
+	}
+	//The flush thread sees the cells before the head that covers them.
+	smp_wmb();
+	WRITE_ONCE(item->glyph_head, head);
+
+	return true;
+}
+
 static void ssd1963_imageblit(struct fb_info *p, const struct fb_image *image)
 {
+	struct ssd1963 *item = (struct ssd1963 *)p->par;
+
 	sys_imageblit(p, image);
+	if (p->fbdefio && ssd1963_queue_glyphs(item, image)) {
+		ssd1963_count_frame(item, 0);
+		ssd1963_schedule_flush_in(item,
+					  ssd1963_rows_delay(item, image->dy,
+							     image->height));
+		return;
+	}
 	ssd1963_touch(p, image->dx, image->dy, image->width, image->height);
 }
 
@@ -692,7 +2147,231 @@ static ssize_t ssd1963_write(struct fb_info *p, const char __user *buf,
 	return res;
 }
 
-static struct fb_ops ssd1963_fbops = {
+static int ssd1963_damage(struct ssd1963 *item, void __user *argp)
+{
+	struct ssd1963_damage damage;
+	struct ssd1963_damage_rect rect;
+	const struct ssd1963_damage_rect __user *rects;
+	unsigned long delay = item->defio.delay;
+	unsigned int i, h;
+	int superseded = 0;
+
+	if (copy_from_user(&damage, argp, sizeof(damage)))
+		return -EFAULT;
+	if (damage.count > SSD1963_DAMAGE_MAX_RECTS)
+		return -EINVAL;
+
+	rects = (const struct ssd1963_damage_rect __user *)
+		(unsigned long)damage.rects;
+	for (i = 0; i < damage.count; i++) {
+		if (copy_from_user(&rect, &rects[i], sizeof(rect)))
+			return -EFAULT;
+		if (rect.y >= item->info->var.yres || !rect.h)
+			continue;
+		h = min_t(unsigned int, rect.h, item->info->var.yres - rect.y);
+		superseded |= ssd1963_mark_rows(item, rect.y, h);
+		delay = min(delay, ssd1963_rows_delay(item, rect.y, h));
+	}
+	ssd1963_count_frame(item, superseded);
+
+	if (damage.flags & SSD1963_DAMAGE_FLUSH)
+		queue_kthread_work(&item->flush_worker, &item->flush_work);
+	else
+		ssd1963_schedule_flush_in(item, delay);
+
+	return 0;
+}
+
+static int ssd1963_set_priority(struct ssd1963 *item, void __user *argp)
+{
+	struct ssd1963_priority prio;
+	struct ssd1963_damage_rect rect;
+	const struct ssd1963_damage_rect __user *rects;
+	unsigned long *pages;
+	unsigned int i, page, last;
+
+	if (copy_from_user(&prio, argp, sizeof(prio)))
+		return -EFAULT;
+	if (prio.count > SSD1963_PRIORITY_MAX_RECTS)
+		return -EINVAL;
+
+	//Built aside and copied in a word at a time, so the flush thread
+	//never sees the regions half cleared.
+	pages = kcalloc(BITS_TO_LONGS(item->pages_count),
+			sizeof(unsigned long), GFP_KERNEL);
+	if (!pages)
+		return -ENOMEM;
+
+	rects = (const struct ssd1963_damage_rect __user *)
+		(unsigned long)prio.rects;
+	for (i = 0; i < prio.count; i++) {
+		if (copy_from_user(&rect, &rects[i], sizeof(rect))) {
+			kfree(pages);
+			return -EFAULT;
+		}
+		if (rect.y >= item->info->var.yres || !rect.h)
+			continue;
+		last = item->row_last_page[min_t(unsigned int,
+					rect.y + rect.h, item->info->var.yres) - 1];
+		for (page = item->row_first_page[rect.y]; page <= last; page++)
+			set_bit(page, pages);
+	}
+
+	item->prio_delay = prio.delay_ms ?
+		min(msecs_to_jiffies(prio.delay_ms), item->defio.delay) : 0;
+	for (i = 0; i < BITS_TO_LONGS(item->pages_count); i++)
+		item->prio_pages[i] = pages[i];
+	kfree(pages);
+
+	return 0;
+}
+
+//Mark the rows an overlay covers, for it to be drawn or taken away.
+static void ssd1963_overlay_touch(struct ssd1963 *item,
+				  const struct ssd1963_overlay *o)
+{
+	if (o->visible && o->width && o->height &&
+	    o->x < (int)item->info->var.xres && o->x + (int)o->width > 0)
+		ssd1963_touch(item->info, o->x, o->y, o->width, o->height);
+}
+
+static int ssd1963_set_sprite(struct ssd1963 *item, void __user *argp)
+{
+	struct ssd1963_sprite sprite;
+	struct ssd1963_overlay *s, old, new;
+	unsigned int size = 0;
+	void *pixels = NULL;
+
+	if (copy_from_user(&sprite, argp, sizeof(sprite)))
+		return -EFAULT;
+	if (sprite.index >= SSD1963_SPRITES)
+		return -EINVAL;
+
+	if (sprite.flags & SSD1963_SPRITE_IMAGE) {
+		if (!sprite.width || sprite.width > SSD1963_SPRITE_MAX ||
+		    !sprite.height || sprite.height > SSD1963_SPRITE_MAX)
+			return -EINVAL;
+		size = sprite.width * sprite.height *
+		       (item->info->var.bits_per_pixel / 8);
+		pixels = kmalloc(size, GFP_KERNEL);
+		if (!pixels)
+			return -ENOMEM;
+		if (copy_from_user(pixels, (const void __user *)
+				   (unsigned long)sprite.pixels, size)) {
+			kfree(pixels);
+			return -EFAULT;
+		}
+	}
+
+	spin_lock(&item->sprite_lock);
+	s = &item->sprites[sprite.index];
+	old = *s;
+	if (pixels) {
+		memcpy(s->pixels, pixels, size);
+		s->width = sprite.width;
+		s->height = sprite.height;
+		s->gen++;
+	}
+	s->x = sprite.x;
+	s->y = sprite.y;
+	s->key = sprite.key;
+	s->visible = !!(sprite.flags & SSD1963_SPRITE_VISIBLE);
+	new = *s;
+	spin_unlock(&item->sprite_lock);
+	kfree(pixels);
+
+	ssd1963_overlay_touch(item, &old);
+	ssd1963_overlay_touch(item, &new);
+
+	return 0;
+}
+
+//Whether the flush numbered seq has finished.
+static inline int ssd1963_flushed(struct ssd1963 *item, u32 seq)
+{
+	return (s32)(item->flush_seq - seq) >= 0;
+}
+
+static int ssd1963_flush_wait(struct ssd1963 *item, void __user *argp)
+{
+	struct ssd1963_flush_wait req;
+	u32 target;
+	long ret;
+
+	if (copy_from_user(&req, argp, sizeof(req)))
+		return -EFAULT;
+
+	//Hand over what deferred io is still sitting on and run the flush
+	//now instead of after the delay.
+	if (item->info->fbdefio)
+		flush_delayed_work(&item->info->deferred_work);
+	del_timer(&item->flush_timer);
+	//Pairs with the swap in ssd1963_flush(): the first flush to start
+	//from here on sees all damage marked so far.
+	smp_mb();
+	target = item->flush_started + 1;
+	queue_kthread_work(&item->flush_worker, &item->flush_work);
+
+	if (req.timeout_ms) {
+		ret = wait_event_interruptible_timeout(item->flush_wq,
+				ssd1963_flushed(item, target),
+				msecs_to_jiffies(req.timeout_ms));
+		if (!ret)
+			return -ETIMEDOUT;
+	} else {
+		ret = wait_event_interruptible(item->flush_wq,
+				ssd1963_flushed(item, target));
+	}
+	if (ret < 0)
+		return ret;
+
+	spin_lock(&item->flush_lock);
+	req.seq = item->flush_seq;
+	req.done_ns = item->flush_done_ns;
+	spin_unlock(&item->flush_lock);
+
+	return copy_to_user(argp, &req, sizeof(req)) ? -EFAULT : 0;
+}
+
+static int ssd1963_ioctl(struct fb_info *info, unsigned int cmd,
+			 unsigned long arg)
+{
+	struct ssd1963 *item = (struct ssd1963 *)info->par;
+	u32 tracking;
+
+	switch (cmd) {
+	case SSD1963IO_DAMAGE:
+		return ssd1963_damage(item, (void __user *)arg);
+	case SSD1963IO_SET_TRACKING:
+		if (get_user(tracking, (u32 __user *)arg))
+			return -EFAULT;
+		item->untracked = !tracking;
+		return 0;
+	case SSD1963IO_FLUSH_WAIT:
+		return ssd1963_flush_wait(item, (void __user *)arg);
+	case SSD1963IO_SET_PRIORITY:
+		return ssd1963_set_priority(item, (void __user *)arg);
+	case SSD1963IO_SET_SPRITE:
+		return ssd1963_set_sprite(item, (void __user *)arg);
+	}
+
+	return -ENOTTY;
+}
+
+//Mappings made while tracking is off see the framebuffer directly, without
+//the write faults deferred io needs to find dirty pages.
+static int ssd1963_mmap(struct fb_info *info, struct vm_area_struct *vma)
+{
+	struct ssd1963 *item = (struct ssd1963 *)info->par;
+
+	if (!item->untracked)
+		return item->defio_mmap(info, vma);
+
+	return remap_vmalloc_range(vma, (void __force *)info->screen_base,
+				   vma->vm_pgoff);
+}
+
+static const struct fb_ops ssd1963_fbops = {
 	.owner        = THIS_MODULE,
 	.fb_read      = fb_sys_read,
 	.fb_write     = ssd1963_write,
@@ -701,27 +2380,17 @@ static struct fb_ops ssd1963_fbops = {
 	.fb_imageblit = ssd1963_imageblit,
 	.fb_setcolreg	= ssd1963_setcolreg,
 	.fb_blank	= ssd1963_blank,
+	.fb_ioctl	= ssd1963_ioctl,
 };
 
-static struct fb_fix_screeninfo ssd1963_fix __initdata = {
+static const struct fb_fix_screeninfo ssd1963_fix = {
 	.id          = "SSD1963",
 	.type        = FB_TYPE_PACKED_PIXELS,
 	.visual      = FB_VISUAL_TRUECOLOR,
 	.accel       = FB_ACCEL_NONE,
-#ifdef LCD_MODE_565RGB
-	.line_length = 320 * 2,
-#else
-	.line_length = 320 * 4,
-#endif
 };
 
-static struct fb_var_screeninfo ssd1963_var __initdata = {
-	.xres		= 320,
-	.yres		= 240,
-	.xres_virtual	= 320,
-	.yres_virtual	= 240,
-	.width		= 320,
-	.height		= 240,
+static const struct fb_var_screeninfo ssd1963_var = {
 #ifdef LCD_MODE_565RGB
 	.bits_per_pixel	= 16,
 	.red		= {11, 5, 0},
@@ -738,12 +2407,183 @@ static struct fb_var_screeninfo ssd1963_var __initdata = {
 	.vmode		= FB_VMODE_NONINTERLACED,
 };
 
-static struct fb_deferred_io ssd1963_defio = {
-        .delay          = HZ / 20,
-        .deferred_io    = &ssd1963_update,
-};
+//Apply the bpp parameter over the build default from ssd1963_var. An 8 bpp
+//framebuffer starts out with an RGB332 palette.
+static int ssd1963_set_format(struct ssd1963 *item)
+{
+	struct fb_info *info = item->info;
+	struct fb_var_screeninfo *var = &info->var;
+	unsigned int i, r, g, b;
+	int ret;
+
+	switch (bpp) {
+	case 0:
+		return 0;
+	case 8:
+		ret = fb_alloc_cmap(&info->cmap, 256, 0);
+		if (ret) {
+			dev_err(item->dev, "%s: unable to fb_alloc_cmap\n",
+				__func__);
+			return ret;
+		}
+		for (i = 0; i < 256; i++) {
+			r = ((i >> 5) & 0x07) * 255 / 7;
+			g = ((i >> 2) & 0x07) * 255 / 7;
+			b = (i & 0x03) * 255 / 3;
+			item->palette[i] = (r << 16) | (g << 8) | b;
+			info->cmap.red[i] = r * 0x101;
+			info->cmap.green[i] = g * 0x101;
+			info->cmap.blue[i] = b * 0x101;
+		}
+		var->bits_per_pixel = 8;
+		var->red.offset = var->green.offset = var->blue.offset = 0;
+		var->red.length = var->green.length = var->blue.length = 8;
+		var->transp.offset = var->transp.length = 0;
+		info->fix.visual = FB_VISUAL_PSEUDOCOLOR;
+		return 0;
+	case 16:
+		var->bits_per_pixel = 16;
+		var->red.offset = 11;
+		var->red.length = 5;
+		var->green.offset = 5;
+		var->green.length = 6;
+		var->blue.offset = 0;
+		var->blue.length = 5;
+		var->transp.offset = var->transp.length = 0;
+		return 0;
+	case 32:
+		var->bits_per_pixel = 32;
+		var->transp.offset = 24;
+		var->transp.length = 8;
+		var->red.offset = 16;
+		var->red.length = 8;
+		var->green.offset = 8;
+		var->green.length = 8;
+		var->blue.offset = 0;
+		var->blue.length = 8;
+		return 0;
+	default:
+		dev_err(item->dev, "%s: unsupported depth %u\n", __func__, bpp);
+		return -EINVAL;
+	}
+}
+
+//Pick the panel from platform_data or the panel parameter.
+static int ssd1963_get_panel(struct ssd1963 *item,
+			     const struct ssd1963_platform_data *pdata)
+{
+	const struct ssd1963_panel *p = pdata ? pdata->panel : NULL;
+	int i;
+
+	for (i = 0; !p && i < ARRAY_SIZE(ssd1963_panels); i++)
+		if (!strcmp(ssd1963_panels[i].name, panel_name))
+			p = &ssd1963_panels[i];
+	if (!p) {
+		dev_err(item->dev, "%s: unknown panel %s\n", __func__,
+			panel_name);
+		return -EINVAL;
+	}
+	if (!p->xres || p->xres > SSD1963_MAX_XRES ||
+	    !p->yres || p->yres > SSD1963_MAX_YRES ||
+	    !p->hsync_len || !p->vsync_len || !p->pclk_khz) {
+		dev_err(item->dev, "%s: bad panel %ux%u\n",
+			__func__, p->xres, p->yres);
+		return -EINVAL;
+	}
+	item->panel = *p;
+	return 0;
+}
 
-static int __init ssd1963_probe(struct platform_device *dev)
+//Size the framebuffer after the panel, swapped to portrait for 90 and 270
+//degree mountings, and set up the shadow walk for the orientations rotated
+//in software.
+static int ssd1963_set_geometry(struct ssd1963 *item)
+{
+	struct fb_var_screeninfo *var = &item->info->var;
+	long stride;
+
+	var->xres = item->panel.xres;
+	var->yres = item->panel.yres;
+	var->width = item->panel.width_mm;
+	var->height = item->panel.height_mm;
+
+	switch (item->rotate) {
+	case 0:
+	case 180:
+		break;
+	case 90:
+	case 270:
+		swap(var->xres, var->yres);
+		swap(var->width, var->height);
+		break;
+	default:
+		dev_err(item->dev, "%s: unsupported rotation %d\n",
+			__func__, item->rotate);
+		return -EINVAL;
+	}
+
+	var->xres_virtual = var->xres;
+	var->yres_virtual = var->yres;
+	item->info->fix.line_length = var->xres * (var->bits_per_pixel / 8);
+
+	item->rot_soft = item->rotate == 90 || item->rotate == 270 ||
+			 (item->rotate == 180 && soft_rotate);
+	stride = item->info->fix.line_length / (var->bits_per_pixel / 8);
+	switch (item->rotate) {
+	case 90:
+		item->rot_origin = (var->yres - 1) * stride;
+		item->rot_dx = -stride;
+		item->rot_dy = 1;
+		break;
+	case 180:
+		item->rot_origin = (var->yres - 1) * stride + var->xres - 1;
+		item->rot_dx = -1;
+		item->rot_dy = -stride;
+		break;
+	case 270:
+		item->rot_origin = var->xres - 1;
+		item->rot_dx = stride;
+		item->rot_dy = -1;
+		break;
+	}
+	return 0;
+}
+
+//Time a full frame and a burst of empty windows on the bus, and express the
+//cost of a window in pixels for the flush planner. The frame comes from the
+//shadow, so the panel keeps showing what it did.
+static void ssd1963_calibrate(struct ssd1963 *item)
+{
+	unsigned int pixels = item->info->var.xres * item->info->var.yres;
+	ktime_t t0, t1, t2;
+	u64 frame_ns, window_ns;
+	int i;
+
+	t0 = ktime_get();
+	ssd1963_send_rect(item, 0, 0, item->info->var.xres,
+			  item->info->var.yres);
+	t1 = ktime_get();
+	for (i = 0; i < SSD1963_CAL_WINDOWS; i++) {
+		nhd_set_window(item, 0, 0, 0, 0);
+		nhd_write_data(item, NHD_COMMAND, 0x2c);
+	}
+	t2 = ktime_get();
+
+	frame_ns = ktime_to_ns(ktime_sub(t1, t0));
+	window_ns = ktime_to_ns(ktime_sub(t2, t1));
+	//A clock too coarse to see the windows leaves the default.
+	if (!frame_ns || !window_ns)
+		return;
+	item->window_cost = clamp_t(u64, div64_u64(window_ns * pixels,
+					frame_ns * SSD1963_CAL_WINDOWS),
+				    1, pixels);
+	dev_info(item->dev, "window costs %u pixels\n", item->window_cost);
+}
+
+//Default deferred io delay; each panel gets its own fb_deferred_io copy.
+#define SSD1963_DEFIO_DELAY		(HZ / 20)
+
+static int ssd1963_probe(struct platform_device *dev)
 {
 	int ret = 0;
 	struct ssd1963 *item;
@@ -751,8 +2591,6 @@ static int __init ssd1963_probe(struct platform_device *dev)
 	struct resource *data_res;
 	unsigned int ctrl_res_size;
 	unsigned int data_res_size;
-	struct resource *ctrl_req;
-	struct resource *data_req;
 	struct fb_info *info;
 
 	dev_dbg(&dev->dev, "%s\n", __func__);
@@ -765,8 +2603,32 @@ static int __init ssd1963_probe(struct platform_device *dev)
 		goto out;
 	}
 	item->dev = &dev->dev;
+	item->window_cost = SSD1963_WINDOW_COST;
+	item->max_fps = min_t(unsigned int, max_fps, HZ);
+	item->flush_order = flush_order < SSD1963_ORDERS ?
+			    flush_order : SSD1963_ORDER_LINEAR;
+	spin_lock_init(&item->flush_lock);
+	spin_lock_init(&item->sprite_lock);
+	init_waitqueue_head(&item->flush_wq);
 	dev_set_drvdata(&dev->dev, item);
 
+	if (dev->dev.platform_data)
+		item->pins = *(struct ssd1963_platform_data *)dev->dev.platform_data;
+	else
+		item->pins = ssd1963_default_pdata;
+	item->rotate = dev->dev.platform_data ? item->pins.rotate : rotate;
+	item->bus_width = item->pins.bus_width ? item->pins.bus_width : 8;
+	if (item->bus_width != 8 && item->bus_width != 9 &&
+	    item->bus_width != 12 && item->bus_width != 16) {
+		dev_err(&dev->dev, "%s: unsupported bus width %u\n",
+			__func__, item->bus_width);
+		ret = -EINVAL;
+		goto out_item;
+	}
+	ret = ssd1963_get_panel(item, dev->dev.platform_data);
+	if (ret)
+		goto out_item;
+
 	ctrl_res = platform_get_resource(dev, IORESOURCE_MEM, 0);
 	if (!ctrl_res) {
 		dev_err(&dev->dev,
@@ -776,9 +2638,9 @@ static int __init ssd1963_probe(struct platform_device *dev)
 		goto out_item;
 	}
 	ctrl_res_size = ctrl_res->end - ctrl_res->start + 1;
-	ctrl_req = request_mem_region(ctrl_res->start, ctrl_res_size,
-				      dev->name);
-	if (!ctrl_req) {
+	item->ctrl_req = request_mem_region(ctrl_res->start, ctrl_res_size,
+					    dev->name);
+	if (!item->ctrl_req) {
 		dev_err(&dev->dev,
 			"%s: unable to request_mem_region for ctrl_req\n",
 			__func__);
@@ -790,7 +2652,7 @@ static int __init ssd1963_probe(struct platform_device *dev)
 		ret = -EINVAL;
 		dev_err(&dev->dev,
 			"%s: unable to ioremap for ctrl_io\n", __func__);
-		goto out_item;
+		goto out_io;
 	}
 
 	data_res = platform_get_resource(dev, IORESOURCE_MEM, 1);
@@ -799,24 +2661,24 @@ static int __init ssd1963_probe(struct platform_device *dev)
 			"%s: unable to platform_get_resource for data_res\n",
 			__func__);
 		ret = -ENOENT;
-		goto out_item;
+		goto out_io;
 	}
 	data_res_size = data_res->end - data_res->start + 1;
-	data_req = request_mem_region(data_res->start,
-				      data_res_size, dev->name);
-	if (!data_req) {
+	item->data_req = request_mem_region(data_res->start,
+					    data_res_size, dev->name);
+	if (!item->data_req) {
 		dev_err(&dev->dev,
 			"%s: unable to request_mem_region for data_req\n",
 			__func__);
 		ret = -EIO;
-		goto out_item;
+		goto out_io;
 	}
 	item->data_io = ioremap(data_res->start, data_res_size);
 	if (!item->data_io) {
 		ret = -EINVAL;
 		dev_err(&dev->dev,
 			"%s: unable to ioremap for data_io\n", __func__);
-		goto out_item;
+		goto out_io;
 	}
 
 	dev_dbg(&dev->dev, "%s: ctrl_io=%p data_io=%p\n",
@@ -826,22 +2688,39 @@ static int __init ssd1963_probe(struct platform_device *dev)
 		 (void *)ctrl_res->start, (void *)data_res->start);
 
 
+	ret = ssd1963_request_gpios(item);
+	if (ret)
+		goto out_io;
+
 	info = framebuffer_alloc(sizeof(struct ssd1963), &dev->dev);
 	if (!info) {
 		ret = -ENOMEM;
 		dev_err(&dev->dev,
 			"%s: unable to framebuffer_alloc\n", __func__);
-		goto out_item;
+		goto out_gpio;
 	}
 	info->pseudo_palette = &item->pseudo_palette;
 	item->info = info;
 	info->par = item;
 	info->dev = &dev->dev;
-	info->fbops = &ssd1963_fbops;
+	item->fbops = ssd1963_fbops;
+	info->fbops = &item->fbops;
 	info->flags = FBINFO_FLAG_DEFAULT;
 	info->fix = ssd1963_fix;
 	info->var = ssd1963_var;
 
+	ret = ssd1963_set_format(item);
+	if (ret)
+		goto out_info;
+
+	ret = ssd1963_set_geometry(item);
+	if (ret)
+		goto out_info;
+
+	ret = ssd1963_select_convert(item);
+	if (ret)
+		goto out_info;
+
 	ret = ssd1963_video_alloc(item);
 	if (ret) {
 		dev_err(&dev->dev,
@@ -856,28 +2735,62 @@ static int __init ssd1963_probe(struct platform_device *dev)
 		goto out_video;
 	}
 
-	info->fbdefio = &ssd1963_defio;
+	//Bring the panel up before the framebuffer goes live, so fbcon
+	//can't reach the bus from the flush thread while we're still
+	//initializing it.
+	ssd1963_setup(item);
+	ssd1963_calibrate(item);
+
+	ret = ssd1963_flush_start(item);
+	if (ret)
+		goto out_pages;
+
+	item->defio.delay = SSD1963_DEFIO_DELAY;
+	item->defio.deferred_io = &ssd1963_update;
+	info->fbdefio = &item->defio;
 	fb_deferred_io_init(info);
+	//Deferred io installs its own mmap; keep it for tracked mappings.
+	item->defio_mmap = info->fbops->fb_mmap;
+	info->fbops->fb_mmap = ssd1963_mmap;
 
 	ret = register_framebuffer(info);
 	if (ret < 0) {
 		dev_err(&dev->dev,
 			"%s: unable to register_frambuffer\n", __func__);
-		goto out_pages;
+		goto out_flush;
 	}
 
+	if (device_create_file(&dev->dev, &dev_attr_flush_prio))
+		dev_warn(&dev->dev, "%s: unable to create flush_prio\n",
+			 __func__);
+	if (device_create_file(&dev->dev, &dev_attr_max_fps))
+		dev_warn(&dev->dev, "%s: unable to create max_fps\n",
+			 __func__);
+	if (device_create_file(&dev->dev, &dev_attr_flush_stats))
+		dev_warn(&dev->dev, "%s: unable to create flush_stats\n",
+			 __func__);
+	if (device_create_file(&dev->dev, &dev_attr_flush_order))
+		dev_warn(&dev->dev, "%s: unable to create flush_order\n",
+			 __func__);
 
-	ssd1963_setup(item);
 	ssd1963_update_all(item);
 
 	return ret;
 
+out_flush:
+	fb_deferred_io_cleanup(info);
+	ssd1963_flush_stop(item);
 out_pages:
 	ssd1963_pages_free(item);
 out_video:
 	ssd1963_video_free(item);
 out_info:
+	fb_dealloc_cmap(&info->cmap);
 	framebuffer_release(info);
+out_gpio:
+	ssd1963_free_gpios(item);
+out_io:
+	ssd1963_release_io(item);
 out_item:
 	kfree(item);
 out:
@@ -887,14 +2800,24 @@ out:
 
 static int ssd1963_remove(struct platform_device *device)
 {
-	struct fb_info *info = platform_get_drvdata(device);
-	struct ssd1963 *item = (struct ssd1963 *)info->par;
-	if (info) {
-		//ToDo: directio-mode: shouldn't those resources be free()'ed too?
+	struct ssd1963 *item = platform_get_drvdata(device);
+	struct fb_info *info;
+
+	if (item) {
+		info = item->info;
+		device_remove_file(&device->dev, &dev_attr_flush_order);
+		device_remove_file(&device->dev, &dev_attr_flush_stats);
+		device_remove_file(&device->dev, &dev_attr_max_fps);
+		device_remove_file(&device->dev, &dev_attr_flush_prio);
 		unregister_framebuffer(info);
+		fb_deferred_io_cleanup(info);
+		ssd1963_flush_stop(item);
 		ssd1963_pages_free(item);
 		ssd1963_video_free(item);
+		fb_dealloc_cmap(&info->cmap);
 		framebuffer_release(info);
+		ssd1963_free_gpios(item);
+		ssd1963_release_io(item);
 		kfree(item);
 	}
 	return 0;
@@ -926,7 +2849,13 @@ static int __init ssd1963_init(void)
 	return ret;
 }
 
+static void __exit ssd1963_exit(void)
+{
+	platform_driver_unregister(&ssd1963_driver);
+}
+
 module_init(ssd1963_init);
+module_exit(ssd1963_exit);
 
 MODULE_LICENSE("GPL v2");
 MODULE_AUTHOR("Alex Nikitenko, alex.nikitenko@sirinsoftware.com");
@@ -0,0 +1,159 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+
+/*
+ * SSD1963 LCD framebuffer driver - board configuration
+ *
+ * Copyright (C) Sirin Software
+ * Author: Alex Nikitenko <alex.nikitenko@sirinsoftware.com>
+ */
+
+#ifndef __SSD1963_H
+#define __SSD1963_H
+
+#include <linux/ioctl.h>
+#include <linux/types.h>
+
+/*
+ * Explicit damage reporting for renderers that know what they drew. The
+ * rectangles are in pixels; they are marked dirty as if they had been written
+ * through mmap, and only the pixels that actually changed go to the panel.
+ */
+struct ssd1963_damage_rect {
+	__u16 x;
+	__u16 y;
+	__u16 w;
+	__u16 h;
+};
+
+struct ssd1963_damage {
+	__u64 rects;	/* user pointer to count struct ssd1963_damage_rect */
+	__u32 count;
+	__u32 flags;	/* SSD1963_DAMAGE_* */
+};
+
+/* Flush right away instead of after the deferred io delay. */
+#define SSD1963_DAMAGE_FLUSH		(1 << 0)
+
+#define SSD1963_DAMAGE_MAX_RECTS	256
+
+#define SSD1963IO_DAMAGE		_IOW('F', 0xa0, struct ssd1963_damage)
+/*
+ * Takes a __u32: 0 maps the framebuffer without write fault tracking for
+ * every mmap() from then on, leaving damage to SSD1963IO_DAMAGE; 1 goes back
+ * to tracking. Mappings that already exist keep the mode they were made in.
+ */
+#define SSD1963IO_SET_TRACKING		_IOW('F', 0xa1, __u32)
+
+/*
+ * Flush pending damage right away and wait until it has reached the panel.
+ * done_ns is the CLOCK_MONOTONIC time the last pixel of that flush was sent.
+ */
+struct ssd1963_flush_wait {
+	__u32 timeout_ms;	/* in: 0 waits as long as it takes */
+	__u32 seq;		/* out: number of the flush that covered it */
+	__u64 done_ns;		/* out: when that flush finished */
+};
+
+#define SSD1963IO_FLUSH_WAIT		_IOWR('F', 0xa2, struct ssd1963_flush_wait)
+
+/*
+ * Regions flushed ahead of the rest of the screen, such as a cursor or touch
+ * feedback. Every flush sends the damage inside them first. With delay_ms
+ * set, damage reported inside them through SSD1963IO_DAMAGE or fbdev drawing
+ * is flushed after that long instead of the deferred io delay. Each call
+ * replaces the previous regions; count 0 clears them.
+ */
+struct ssd1963_priority {
+	__u64 rects;	/* user pointer to count struct ssd1963_damage_rect */
+	__u32 count;
+	__u32 delay_ms;	/* 0 keeps the deferred io delay */
+};
+
+#define SSD1963_PRIORITY_MAX_RECTS	16
+
+#define SSD1963IO_SET_PRIORITY		_IOW('F', 0xa3, struct ssd1963_priority)
+
+/*
+ * Software overlays drawn over the framebuffer on the way to the panel, such
+ * as a mouse or touch cursor. They never touch the framebuffer itself: moving
+ * one only resends what changed where it was and where it is now. Sprite 0
+ * is drawn on top of the others and is meant for the cursor. x and y may be
+ * off screen. With SSD1963_SPRITE_IMAGE the call also replaces the image,
+ * width x height pixels in framebuffer format; otherwise those fields and
+ * pixels are ignored. Pixels equal to key are transparent.
+ */
+struct ssd1963_sprite {
+	__u32 index;	/* 0 .. SSD1963_SPRITES - 1 */
+	__u32 flags;	/* SSD1963_SPRITE_* */
+	__s32 x;
+	__s32 y;
+	__u32 width;
+	__u32 height;
+	__u32 key;
+	__u32 reserved;
+	__u64 pixels;	/* user pointer, rows of width pixels */
+};
+
+#define SSD1963_SPRITE_VISIBLE		(1 << 0)
+#define SSD1963_SPRITE_IMAGE		(1 << 1)
+
+#define SSD1963_SPRITES			4
+#define SSD1963_SPRITE_MAX		64
+
+#define SSD1963IO_SET_SPRITE		_IOW('F', 0xa4, struct ssd1963_sprite)
+
+#ifdef __KERNEL__
+
+/* Widest pixel data bus the controller has. */
+#define SSD1963_DATA_PINS	16
+
+/* Largest panel the controller can drive. */
+#define SSD1963_MAX_XRES	864
+#define SSD1963_MAX_YRES	480
+
+/*
+ * Timings of the TFT panel behind the controller. Porches and sync pulses
+ * are in pixel clocks horizontally and in lines vertically.
+ */
+struct ssd1963_panel {
+	const char *name;
+	unsigned int xres;
+	unsigned int yres;
+	unsigned int width_mm;
+	unsigned int height_mm;
+	unsigned int pclk_khz;
+	unsigned int hsync_len;
+	unsigned int hback_porch;
+	unsigned int hfront_porch;
+	unsigned int vsync_len;
+	unsigned int vback_porch;
+	unsigned int vfront_porch;
+	/* First byte of set_lcd_mode (0xb0): panel data width, dithering,
+	 * LSHIFT and sync polarities. */
+	unsigned char lcd_mode;
+};
+
+/*
+ * GPIO wiring of one panel on the 8080 bus. Pass it as platform_data of an
+ * "ssd1963" platform device; one device per panel. Without platform_data the
+ * driver falls back to the IPC-SAM9G45 wiring.
+ */
+struct ssd1963_platform_data {
+	unsigned int data_pins[SSD1963_DATA_PINS];	/* D0.., bus_width of them */
+	unsigned int reset_pin;
+	unsigned int dc_pin;
+	unsigned int rd_pin;
+	unsigned int wr_pin;
+	unsigned int cs_pin;
+	/* Wired data lines: 8 (also 0), 9, 12 or 16. Pixels take three bus
+	 * cycles at 8 bits, two at 9 (6-6-6) and 12 (8-8-8), and one at 16
+	 * (5-6-5); commands always use D0..D7. */
+	unsigned int bus_width;
+	int rotate;		/* 0, 90, 180 or 270 degrees clockwise */
+	/* NULL picks one of the built-in panels by the panel module parameter */
+	const struct ssd1963_panel *panel;
+};
+
+#endif /* __KERNEL__ */
+
+#endif /* __SSD1963_H */